@@ -2,29 +2,28 @@
 //
 
 #include "model.h"
+#include "native.h"
+#include "scene-cache.h"
 #include "cl-helper.h"
+#include "timer.h"
+#ifndef HEADLESS
 #include <SDL/SDL.h>
 #include <SDL/SDL_opengl.h>
 #include <GL/glx.h>
+#endif
 #include <iostream>
 #include <iomanip>
+#include <vector>
+#include <algorithm>
 #include <cstring>
 #include <cstdlib>
+#include <cstdio>
 
 using namespace std;
 
 
 
-typedef long long nsec_type;
-
-inline nsec_type get_time()
-{
-    timespec ts;  clock_gettime(CLOCK_MONOTONIC, &ts);
-    return 1000000000 * nsec_type(ts.tv_sec) + ts.tv_nsec;
-}
-
-
-
+#ifndef HEADLESS
 inline cl_int delete_texture(GLuint tex)
 {
     glDeleteTextures(1, &tex);  return 0;
@@ -40,6 +39,7 @@ bool sdl_error(const char *text)
 {
     cout << text << SDL_GetError() << endl;  SDL_ClearError();  return false;
 }
+#endif
 
 bool opencl_error(const char *text, cl_int err)
 {
@@ -47,11 +47,53 @@ bool opencl_error(const char *text, cl_int err)
 }
 
 
+enum Backend
+{
+    bk_opencl, bk_native, bk_check  // check -- both, images compared every frame
+};
+
+struct TraceSettings
+{
+    Backend backend;
+    unsigned threads;  bool pin_threads;  // native backend, 0 -- all hardware threads
+    bool ray_soa;  // structure-of-arrays ray state
+    unsigned radix_shift;  // sort digit width, 0 -- select by device
+    bool bin_sort;  // group rays by atomic counting instead of radix sort
+    bool stack_traversal;  // whole ray per launch instead of wavefront steps
+    unsigned persistent;  // process units per compute unit, 0 -- unit per ray batch
+    const char *profile;  // kernel timing report: "print" or CSV file name, 0 -- off
+    const char *program_cache;  // directory of compiled programs, 0 -- off
+
+    TraceSettings() : backend(bk_opencl), threads(0), pin_threads(false), ray_soa(false), radix_shift(0), bin_sort(false), stack_traversal(false), persistent(0), profile(0),
+        program_cache(0)
+    {
+    }
+};
+
+struct SceneSettings
+{
+    static const size_t max_models = 8;
+    const char *models;  // comma-separated PLY files, instances alternate between them
+    size_t instance_count;  unsigned seed, device;  // device index in platform
+    const char *cache;  // built scene file, 0 -- off
+
+    SceneSettings() : models("bun_zipper.ply,dragon_vrip.ply"), instance_count(256), seed(1), device(0), cache(0)
+    {
+    }
+};
+
+struct StepTime
+{
+    size_t steps;  double trace, sort, passes;  // ms per step, radix passes per step
+    cl_uint lost;  // AABB hits dropped without revisit, total of all steps
+};
+
+
 class RayTracer
 {
     struct Kernel : public CLKernel
     {
-        const char *name;
+        const char *name;  vector<cl_ulong> time;  // profiled durations, ns
 
         Kernel() : name(0)
         {
@@ -64,14 +106,26 @@ class RayTracer
     };
 
 
-    size_t warp_width, unit_width, width, height, area_size, ray_count, group_count;
-    GLTexture texture;  CLContext context;  cl_device_id device;  CLQueue queue;  CLProgram program;
-    CLBuffer global, area, ray_list, grp_data, ray_index[2], grp_list, mat_list, aabb_list, vtx_list, tri_list, image;
+    size_t warp_width, unit_width, width, height, area_size, ray_count, group_count, process_size;
+#ifndef HEADLESS
+    GLTexture texture;
+#endif
+    SceneCache cache;  // must outlive buffers using its memory
+    CLContext context;  cl_device_id device;  CLQueue queue;  CLProgram program;
+    CLBuffer global, area, ray_list, queue_list, grp_data, grp_sum, ray_index[2], grp_list, mat_list, aabb_list, vtx_list, tri_list, rec_list, image;
     Kernel init_groups, init_rays, init_image, process, count_groups, update_groups, set_ray_index, update_image;
+    Kernel clear_bins, count_bins, reduce_groups, scan_group_sums, trace_stack;
+    BuildSettings build;  TraceSettings trace;  SceneSettings scene;
 
-    size_t sort_block, block_count;
+    size_t sort_block, block_count;  cl_uint radix_shift;
     CLBuffer sort_count, local_index, global_index;
-    Kernel local_count, global_count, shuffle_data;
+    Kernel local_count, global_count, shuffle_data, sort_finish;
+
+    size_t step_count;  cl_uint sort_passes, lost_hits;  nsec_type trace_time, sort_time;  // device counters at last step_time
+    vector<Kernel *> kernel_list, event_kernel;  vector<cl_event> event_list;  // profiling
+    cl_uint trace_offset;  // next pixel of stack traversal
+    NativeTracer native;
+    size_t band_begin, band_rows;  Camera camera;  // rendered rows of full frame camera
 
 
     enum BufferFlags
@@ -90,6 +144,12 @@ class RayTracer
         cout << "Cannot create buffer \"" << name << "\": " << cl_error_string(err) << endl;  return false;
     }
 
+    bool create_scene_buffer(CLBuffer &buf, const char *name, cl_mem_flags flags, size_t size, void *ptr)  // can be empty
+    {
+        if(size)return create_buffer(buf, name, mem_ro | flags, size, ptr);
+        return create_buffer(buf, name, mem_ro, sizeof(cl_float4));
+    }
+
     bool create_sub_buffer(CLBuffer &buf, const char *name, cl_mem from, cl_mem_flags flags, size_t offs, size_t size)
     {
         cl_buffer_region region = {offs, size};  cl_int err;
@@ -99,7 +159,11 @@ class RayTracer
 
     bool create_kernel(Kernel &kernel, const char *name)
     {
-        cl_int err;  kernel = clCreateKernel(program, kernel.name = name, &err);  if(err == CL_SUCCESS)return true;
+        cl_int err;  kernel = clCreateKernel(program, kernel.name = name, &err);
+        if(err == CL_SUCCESS)
+        {
+            kernel_list.push_back(&kernel);  return true;
+        }
         cout << "Cannot create kernel \"" << name << "\": " << cl_error_string(err) << endl;  return false;
     }
 
@@ -120,9 +184,19 @@ class RayTracer
         return set_kernel_arg(kernel, arg, sizeof(cl_uint), &val);
     }
 
-    bool run_kernel(const Kernel &kernel, size_t size)
+    bool run_kernel(Kernel &kernel, size_t size, cl_event *done = 0)  // done -- released by caller
     {
-        cl_int err = clEnqueueNDRangeKernel(queue, kernel, 1, 0, &size, &unit_width, 0, 0, 0);  if(err == CL_SUCCESS)return true;
+        cl_event evt;
+        cl_int err = clEnqueueNDRangeKernel(queue, kernel, 1, 0, &size, &unit_width, 0, 0, trace.profile || done ? &evt : 0);
+        if(err == CL_SUCCESS)
+        {
+            if(done)
+            {
+                *done = evt;  if(trace.profile)clRetainEvent(evt);
+            }
+            if(!trace.profile)return true;
+            event_kernel.push_back(&kernel);  event_list.push_back(evt);  return true;
+        }
         cout << "Cannot execute kernel \"" << kernel.name << "\": " << cl_error_string(err) << endl;  return false;
     }
 
@@ -168,22 +242,44 @@ class RayTracer
     }
 
 
+#ifndef HEADLESS
     bool init_gl();
+#endif
     bool init_cl(cl_platform_id platform);
+    bool select_radix();
+    bool program_file(const char *options, char *file, size_t size);
+    bool load_program(const char *file);
+    bool save_program(const char *file);
     bool build_program();
+    bool scene_key(const char *const *name, size_t n_model, cl_ulong &key);
+    bool build_scene(const char *const *name, size_t n_model, const vector<Matrix> &mat, ResourceManager &mngr, SceneData &res);
     bool create_buffers();
-    bool create_buffers(GlobalData &data, Group *grp, Matrix *mat, size_t mat_count,
-        AABB *aabb, size_t aabb_count, Vertex *vtx, size_t vtx_count, cl_uint *tri, size_t tri_count);
+    bool create_buffers(GlobalData &data, const SceneData &scn, Matrix *mat, size_t mat_count, cl_mem_flags scene_flags);
     bool create_kernels();
+    bool sort_rays();
+    bool bin_rays();
+    bool trace_step();
+    void native_step();
+    bool sync_native();
 
     static size_t align(size_t val, size_t unit)
     {
         return (val + unit - 1) / unit * unit;
     }
 
+    Camera band_camera() const
+    {
+        Camera cam = camera;  cam.height = band_rows;
+        for(int k = 0; k < 3; k++)cam.top_left.s[k] += band_begin * cam.dy.s[k];
+        return cam;
+    }
+
 public:
-    RayTracer(size_t width_, size_t height_, size_t ray_count_) :
-        warp_width(32), unit_width(512), width(width_), height(height_), area_size(width_ * height_), sort_block(16)
+    RayTracer(size_t width_, size_t height_, size_t ray_count_,
+        const BuildSettings &build_, const TraceSettings &trace_, const SceneSettings &scene_) :
+        warp_width(32), unit_width(512), width(width_), height(height_), area_size(width_ * height_),
+        build(build_), trace(trace_), scene(scene_), sort_block(16), step_count(0), sort_passes(0), lost_hits(0), trace_time(0), sort_time(0), trace_offset(0),
+        band_begin(0), band_rows(height_)
     {
         ray_count = align(ray_count_, unit_width * sort_block);
         block_count = ray_count / (unit_width * sort_block);
@@ -191,22 +287,81 @@ public:
 
     bool init(cl_platform_id platform)
     {
-        return init_gl() && init_cl(platform) && build_program() && create_buffers() && create_kernels();
+#ifndef HEADLESS
+        if(!init_gl())return false;
+#endif
+        return init_cl(platform) && create_buffers() && build_program() && create_kernels();  // program depends on group count
     }
 
     bool init_frame();
     bool make_step();
     bool draw_frame();
+    bool profile_report();
+#ifdef HEADLESS
+    bool save_frame(const char *file);
+    bool set_band(size_t begin, size_t rows);  // image rows to render, init_frame must follow
+    bool read_area(cl_float4 *buf);  // accumulated pixels of band
+#endif
+
+    bool collect_profile()  // after queue finish
+    {
+        for(size_t i = 0; i < event_list.size(); i++)
+        {
+            cl_ulong start, end;
+            cl_int err = clGetEventProfilingInfo(event_list[i], CL_PROFILING_COMMAND_START, sizeof(start), &start, 0);
+            if(err == CL_SUCCESS)err = clGetEventProfilingInfo(event_list[i], CL_PROFILING_COMMAND_END, sizeof(end), &end, 0);
+            if(err == CL_SUCCESS)event_kernel[i]->time.push_back(end - start);
+            clReleaseEvent(event_list[i]);
+            if(err != CL_SUCCESS)
+            {
+                for(i++; i < event_list.size(); i++)clReleaseEvent(event_list[i]);
+                event_list.clear();  event_kernel.clear();  return opencl_error("Cannot get profiling info: ", err);
+            }
+        }
+        event_list.clear();  event_kernel.clear();  return true;
+    }
+
+    StepTime step_time()  // since last call
+    {
+        StepTime res = {step_count, 0, 0, 0, 0};  cl_uint count[2] = {sort_passes, lost_hits};  // adjacent in GlobalData
+        if(trace.backend != bk_native)
+        {
+            cl_int err = clEnqueueReadBuffer(queue, global, CL_TRUE, offsetof(GlobalData, sort_passes), sizeof(count), count, 0, 0, 0);
+            if(err != CL_SUCCESS)opencl_error("Cannot read buffer data: ", err);
+        }
+        if(step_count)
+        {
+            res.trace = 1e-6 * trace_time / step_count;  res.sort = 1e-6 * sort_time / step_count;
+            res.passes = double(count[0] - sort_passes) / step_count;
+        }
+        res.lost = count[1] - lost_hits;  step_count = 0;  sort_passes = count[0];  lost_hits = count[1];
+        trace_time = sort_time = 0;  return res;
+    }
 
-    cl_uint current_ray()
+    bool read_counters(cl_uint &ray, cl_uint *done = 0)  // done[2] -- finished primary / shadow rays
     {
         GlobalData data;
-        cl_int err = clEnqueueReadBuffer(queue, global, CL_TRUE, 0, sizeof(data), &data, 0, 0, 0);
-        if(err == CL_SUCCESS)return data.pixel_offset;  opencl_error("Cannot read buffer data: ", err);  return 0;
+        if(trace.backend == bk_native)data = native.global_data();
+        else
+        {
+            cl_int err = clEnqueueReadBuffer(queue, global, CL_TRUE, 0, sizeof(data), &data, 0, 0, 0);
+            if(err != CL_SUCCESS)return opencl_error("Cannot read buffer data: ", err);
+        }
+        if(done)
+        {
+            done[rt_primary] = data.done_count[rt_primary];  done[rt_shadow] = data.done_count[rt_shadow];
+        }
+        ray = data.pixel_offset;  return true;
+    }
+
+    cl_uint current_ray(cl_uint *done = 0)  // zero on error
+    {
+        cl_uint ray = 0;  return read_counters(ray, done) ? ray : 0;
     }
 };
 
 
+#ifndef HEADLESS
 bool RayTracer::init_gl()
 {
     glGenTextures(1, &texture.value());  glBindTexture(GL_TEXTURE_2D, texture);
@@ -215,157 +370,331 @@ bool RayTracer::init_gl()
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
     glEnable(GL_TEXTURE_2D);  glColor3f(1, 1, 1);  return true;
 }
+#endif
 
 bool RayTracer::init_cl(cl_platform_id platform)
 {
+#ifdef HEADLESS
+    cl_context_properties prop[] =
+    {
+        CL_CONTEXT_PLATFORM, cl_context_properties(platform), 0
+    };
+    const cl_device_type type = CL_DEVICE_TYPE_ALL;
+#else
     cl_context_properties prop[] =
     {
         CL_GL_CONTEXT_KHR, cl_context_properties(glXGetCurrentContext()),
         CL_GLX_DISPLAY_KHR, cl_context_properties(glXGetCurrentDisplay()),
         CL_CONTEXT_PLATFORM, cl_context_properties(platform), 0
     };
+    const cl_device_type type = CL_DEVICE_TYPE_GPU;
+#endif
 
-    cl_int err;
-    context = clCreateContextFromType(prop, CL_DEVICE_TYPE_GPU, 0, 0, &err);
-    if(err != CL_SUCCESS)return opencl_error("Cannot create context: ", err);
-
-    size_t res_size;
-    err = clGetContextInfo(context, CL_CONTEXT_DEVICES, sizeof(device), &device, &res_size);
-    if(err != CL_SUCCESS)return opencl_error("Cannot get device from context: ", err);
-    if(res_size < sizeof(device))
+    const cl_uint max_devices = 16;  cl_device_id list[max_devices];  cl_uint device_count;
+    cl_int err = clGetDeviceIDs(platform, type, max_devices, list, &device_count);
+    if(err != CL_SUCCESS)return opencl_error("Cannot get device list: ", err);
+    if(scene.device >= std::min(device_count, max_devices))
     {
-        cout << "Cannot get device from context!" << endl;  return false;
+        cout << "Invalid device index!" << endl;  return false;
     }
+    device = list[scene.device];  char name[256];
+    err = clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name), name, 0);
+    if(err != CL_SUCCESS)return opencl_error("Cannot get device info: ", err);
+    cout << "Device " << scene.device << ": " << name << endl;
+
+    context = clCreateContext(prop, 1, &device, 0, 0, &err);
+    if(err != CL_SUCCESS)return opencl_error("Cannot create context: ", err);
 
-    queue = clCreateCommandQueue(context, device, 0, &err);
+    queue = clCreateCommandQueue(context, device, trace.profile ? CL_QUEUE_PROFILING_ENABLE : 0, &err);
     if(err != CL_SUCCESS)return opencl_error("Cannot create command queue: ", err);
     return true;
 }
 
-bool RayTracer::build_program()
+bool RayTracer::select_radix()
 {
-    const char *src = "#include \"ray-tracer.cl\"";  cl_int err;
-    program = clCreateProgramWithSource(context, 1, &src, 0, &err);
-    if(err != CL_SUCCESS)return opencl_error("Cannot create program: ", err);
+    cl_uint bits = 0;
+    while(bits < 32 && (group_count - 1) >> bits)bits++;
+    if(!bits)bits = 1;  // single group, sort is never run
 
-    char buf[65536];
-    sprintf(buf, "-DWARP_WIDTH=%zu -DUNIT_WIDTH=%zu -DSORT_BLOCK=%zu "
-        "-cl-mad-enable -cl-nv-verbose", warp_width, unit_width, sort_block);
-    int build_err = clBuildProgram(program, 1, &device, buf, 0, 0);
-    err = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, sizeof(buf), buf, 0);
-    if(err != CL_SUCCESS)return opencl_error("Cannot get build info: ", err);
-    // The OpenCL Specification, version 1.1, revision 44 (6/1/11), section 4.1, page 33 footnote:
-    // A null terminated string is returned by OpenCL query function calls if the return type of the information being
-    // queried is a char[].
+    radix_shift = trace.radix_shift;
+    if(!radix_shift)
+    {
+        // every digit value costs a private counter of local_count and a local scan per block:
+        // past 32 counters they spill from registers and scans outweigh the saved pass
+        cl_device_local_mem_type type;
+        cl_int err = clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_TYPE, sizeof(type), &type, 0);
+        if(err != CL_SUCCESS)return opencl_error("Cannot get device local memory type: ", err);
+
+        cl_uint max_shift = type != CL_LOCAL ? 4 : 5;
+        cl_uint passes = (bits + max_shift - 1) / max_shift;  radix_shift = (bits + passes - 1) / passes;
+    }
+    if(trace.bin_sort)cout << "Ray sort: counting by group." << endl;
+    else cout << "Ray sort: " << radix_shift << "-bit digits, " <<
+        (bits + radix_shift - 1) / radix_shift << " passes at most." << endl;
+    return true;
+}
 
-    cout << "Build log:\n" << buf << endl;
-    if(build_err == CL_SUCCESS)cout << "Compilation successfull." << endl;
-    else cout << "Compilation failed: " << cl_error_string(build_err) << endl;
-    return build_err == CL_SUCCESS;
+bool RayTracer::program_file(const char *options, char *file, size_t size)  // name from hash of device, options and sources
+{
+    char name[256], driver[256];
+    cl_int err = clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name), name, 0);
+    if(err == CL_SUCCESS)err = clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driver), driver, 0);
+    if(err != CL_SUCCESS)return opencl_error("Cannot get device info: ", err);
+
+    cl_ulong key = hash_data(name, strlen(name) + 1);
+    key = hash_data(driver, strlen(driver) + 1, key);  key = hash_data(options, strlen(options) + 1, key);
+    static const char *source[] = {"ray-tracer.cl", "ray-tracer.h", "sort.cl", "shader.cl"};
+    for(size_t i = 0; i < sizeof(source) / sizeof(source[0]); i++)if(!hash_file(source[i], key))
+    {
+        cout << "Cannot read file \"" << source[i] << "\"!" << endl;  return false;
+    }
+    snprintf(file, size, "%s/ray-tracer-%016llx.bin", trace.program_cache, (unsigned long long)key);  return true;
 }
 
+bool RayTracer::load_program(const char *file)
+{
+    FILE *input = fopen(file, "rb");  if(!input)return false;
+    vector<unsigned char> bin;  unsigned char buf[65536];
+    for(size_t len; (len = fread(buf, 1, sizeof(buf), input));)bin.insert(bin.end(), buf, buf + len);
+    bool res = !ferror(input) && !bin.empty();  fclose(input);  if(!res)return false;
+
+    const unsigned char *ptr = &bin[0];  size_t size = bin.size();  cl_int status, err;
+    program = clCreateProgramWithBinary(context, 1, &device, &size, &ptr, &status, &err);
+    if(err == CL_SUCCESS && status == CL_SUCCESS)
+    {
+        cout << "Program loaded from \"" << file << "\"." << endl;  return true;
+    }
+    if(program)clReleaseProgram(program.detach());
+    cout << "Cached program rejected: " << cl_error_string(err != CL_SUCCESS ? err : status) << endl;  return false;
+}
 
-bool RayTracer::create_buffers()
+bool RayTracer::save_program(const char *file)
 {
-    const size_t tri_threshold = 128, aabb_threshold = 128;
+    size_t size;  cl_int err = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, 0);
+    if(err != CL_SUCCESS)return opencl_error("Cannot get program binary size: ", err);
+    if(!size)return true;  // nothing to store
 
-    const size_t n_obj = 256;
-    Matrix mat[n_obj];  memset(mat, 0, sizeof(mat));
-    for(size_t i = 0; i < n_obj; i++)
+    vector<unsigned char> bin(size);  unsigned char *ptr = &bin[0];
+    err = clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(ptr), &ptr, 0);
+    if(err != CL_SUCCESS)return opencl_error("Cannot get program binary: ", err);
+
+    char tmp[1024];  snprintf(tmp, sizeof(tmp), "%s.tmp", file);  // concurrent starts see whole file or none
+    FILE *output = fopen(tmp, "wb");
+    if(!output)
     {
-        double alpha = 2 * 3.14159265359 * random() / RAND_MAX;
-        mat[i].x.s[0] = mat[i].y.s[2] = cos(alpha);
-        mat[i].x.s[2] = -(mat[i].y.s[0] = sin(alpha));
-        mat[i].z.s[1] = 1;
+        cout << "Cannot open file \"" << tmp << "\"!" << endl;  return false;
+    }
+    bool res = fwrite(ptr, 1, size, output) == size;
+    if(fclose(output) || !res || rename(tmp, file))
+    {
+        remove(tmp);  cout << "Cannot write file \"" << file << "\"!" << endl;  return false;
+    }
+    cout << "Program binary written to \"" << file << "\"." << endl;  return true;
+}
 
-        mat[i].x.s[3] = 4.0 * random() / RAND_MAX - 2;
-        mat[i].y.s[3] = 4.0 * random() / RAND_MAX;
-        mat[i].z.s[3] = 2.0 * random() / RAND_MAX - 1;
+bool RayTracer::build_program()
+{
+    char options[1024];
+    int len = sprintf(options, "-DWARP_WIDTH=%zu -DUNIT_WIDTH=%zu -DSORT_BLOCK=%zu -DRADIX_SHIFT=%u ",
+        warp_width, unit_width, sort_block, radix_shift);
+    if(trace.ray_soa)len += sprintf(options + len, "-DRAY_SOA -DRAY_COUNT=%zu ", ray_count);
+    if(trace.persistent)len += sprintf(options + len, "-DPERSISTENT ");
+    if(trace.bin_sort)len += sprintf(options + len, "-DBIN_SORT ");
+    sprintf(options + len,
+#ifdef HEADLESS
+        "-DHEADLESS "
+#endif
+        "-cl-mad-enable -cl-nv-verbose");
+
+    char file[1024];  bool use_cache = trace.program_cache && program_file(options, file, sizeof(file));
+    for(bool cached = use_cache && load_program(file);; cached = false)
+    {
+        cl_int err;
+        if(!cached)
+        {
+            const char *src = "#include \"ray-tracer.cl\"";
+            program = clCreateProgramWithSource(context, 1, &src, 0, &err);
+            if(err != CL_SUCCESS)return opencl_error("Cannot create program: ", err);
+        }
+
+        char buf[65536];
+        int build_err = clBuildProgram(program, 1, &device, options, 0, 0);
+        err = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, sizeof(buf), buf, 0);
+        if(err != CL_SUCCESS)return opencl_error("Cannot get build info: ", err);
+        // The OpenCL Specification, version 1.1, revision 44 (6/1/11), section 4.1, page 33 footnote:
+        // A null terminated string is returned by OpenCL query function calls if the return type of the information being
+        // queried is a char[].
+
+        cout << "Build log:\n" << buf << endl;
+        if(build_err == CL_SUCCESS)cout << "Compilation successfull." << endl;
+        else cout << "Compilation failed: " << cl_error_string(build_err) << endl;
+        if(cached && build_err != CL_SUCCESS)
+        {
+            clReleaseProgram(program.detach());  continue;  // unusable binary, compile source
+        }
+        if(build_err == CL_SUCCESS && use_cache && !cached)save_program(file);  // failure is not fatal
+        return build_err == CL_SUCCESS;
     }
-    ResourceManager mngr;  mngr.reserve_groups(6);
-    mngr.reserve_aabbs(n_obj);
+}
 
 
-    Model bunny;
-    cout << "Loading bunny model..." << endl;
-    if(!bunny.load("bun_zipper.ply"))
+bool RayTracer::scene_key(const char *const *name, size_t n_model, cl_ulong &key)
+{
+    const cl_ulong param[] =
     {
-        cout << "Failed to load bunny model!" << endl;  return false;
+        SceneCache::version, sizeof(Group), sizeof(AABB), sizeof(Vertex), unit_width, scene.instance_count, scene.seed,
+        build.tri_threshold, build.aabb_threshold, build.max_fanout, build.sah, build.bin_count,
+        build.task_threshold, build.tri_format, build.quantize, n_model
+    };
+    key = hash_data(param, sizeof(param));
+    key = hash_data(&build.leaf_cost, sizeof(build.leaf_cost), key);
+    key = hash_data(&build.traversal_cost, sizeof(build.traversal_cost), key);
+    for(size_t i = 0; i < n_model; i++)if(!hash_file(name[i], key))
+    {
+        cout << "Cannot read model \"" << name[i] << "\"!" << endl;  return false;
     }
-    bunny.subdivide(tri_threshold, aabb_threshold);
-    bunny.reserve(mngr);
+    return true;
+}
 
+bool RayTracer::build_scene(const char *const *name, size_t n_model, const vector<Matrix> &mat, ResourceManager &mngr, SceneData &res)
+{
+    const size_t n_obj = mat.size();
+    mngr.reserve_groups(4 + n_model);  mngr.reserve_aabbs(n_obj);  ThreadPool pool;
 
-    Model dragon;
-    cout << "Loading dragon model..." << endl;
-    if(!dragon.load("dragon_vrip.ply"))
-    //if(!dragon.load("bun_zipper.ply"))
+    vector<Model> model(n_model);
+    for(size_t i = 0; i < n_model; i++)
     {
-        cout << "Failed to load dragon model!" << endl;  return false;
+        cout << "Loading model \"" << name[i] << "\"..." << endl;
+        if(!model[i].load(name[i], &pool))
+        {
+            cout << "Failed to load model \"" << name[i] << "\"!" << endl;  return false;
+        }
+        model[i].subdivide(build, &pool);
+        model[i].reserve(mngr, &pool);
     }
-    dragon.subdivide(tri_threshold, aabb_threshold);
-    dragon.reserve(mngr);
 
 
     mngr.alloc();  mngr.get_groups(3);  // predefined (spawn, sky, light)
-    cl_uint green_id = make_group_id(mngr.get_groups(1), tr_none, sh_material);
-    cl_uint red_id = make_group_id(mngr.get_groups(1), tr_none, sh_material);
+    vector<cl_uint> material_id(n_model);
+    for(size_t i = 0; i < n_model; i++)
+        material_id[i] = make_group_id(mngr.get_groups(1), tr_none, sh_material);
     cl_uint aabb_id = make_group_id(mngr.get_groups(1), tr_identity, sh_aabb);
 
     Group *grp = mngr.group(aabb_id & GROUP_ID_MASK);
     AABB *aabb = mngr.aabb(grp->aabb.aabb_offs = mngr.get_aabbs(n_obj));
     grp->aabb.aabb_count = n_obj;  grp->aabb.flags = f_local0;
 
-    grp = mngr.group(green_id & GROUP_ID_MASK);  grp->material.color.s[3] = 0.1;
-    grp->material.color.s[0] = 0.2;  grp->material.color.s[1] = 0.9;  grp->material.color.s[2] = 0.2;
+    static const float palette[][3] = {{0.2, 0.9, 0.2}, {0.9, 0.2, 0.2}, {0.2, 0.2, 0.9}, {0.9, 0.9, 0.2}};
+    const size_t n_color = sizeof(palette) / sizeof(palette[0]);
+    cout << "SAH cost (" << (build.sah ? "binned SAH" : "median") << " builder):";
+    for(size_t i = 0; i < n_model; i++)
+    {
+        grp = mngr.group(material_id[i] & GROUP_ID_MASK);  grp->material.color.s[3] = 0.1;
+        for(int k = 0; k < 3; k++)grp->material.color.s[k] = palette[i % n_color][k];
+        model[i].fill(mngr, material_id[i], &pool);  cout << (i ? ", " : " ") << model[i].sah_cost();
+    }
+    cout << endl;
+    for(size_t i = 0; i < n_obj; i++)model[i % n_model].put(aabb[i], mat[i], i);
+    res = mngr.scene_data(aabb_id);  return true;
+}
+
+bool RayTracer::create_buffers()
+{
+    char list[1024];  const char *name[SceneSettings::max_models];  size_t n_model = 0;
+    snprintf(list, sizeof(list), "%s", scene.models);
+    for(char *ptr = strtok(list, ","); ptr && n_model < SceneSettings::max_models; ptr = strtok(0, ","))name[n_model++] = ptr;
+    if(!n_model)
+    {
+        cout << "No models in scene!" << endl;  return false;
+    }
+
+    const size_t n_obj = scene.instance_count;
+    vector<Matrix> mat(n_obj);  srandom(scene.seed);
+    for(size_t i = 0; i < n_obj; i++)
+    {
+        double alpha = 2 * 3.14159265359 * random() / RAND_MAX;
+        mat[i].x.s[0] = mat[i].y.s[2] = cos(alpha);
+        mat[i].x.s[2] = -(mat[i].y.s[0] = sin(alpha));
+        mat[i].z.s[1] = 1;
 
-    grp = mngr.group(red_id & GROUP_ID_MASK);  grp->material.color.s[3] = 0.1;
-    grp->material.color.s[0] = 0.9;  grp->material.color.s[1] = 0.2;  grp->material.color.s[2] = 0.2;
+        mat[i].x.s[3] = 4.0 * random() / RAND_MAX - 2;
+        mat[i].y.s[3] = 4.0 * random() / RAND_MAX;
+        mat[i].z.s[3] = 2.0 * random() / RAND_MAX - 1;
+    }
 
-    bunny.fill(mngr, green_id);  dragon.fill(mngr, red_id);
-    for(size_t i = 0; i < n_obj; i++)(i & 1 ? dragon : bunny).put(aabb[i], mat[i], i);
-    assert(mngr.full());
+    ResourceManager mngr;  SceneData scn;  cl_ulong key = 0;  bool cached = false;
+    if(scene.cache && !scene_key(name, n_model, key))return false;
+    if(scene.cache && (cached = cache.open(scene.cache, key, scn)))cout << "Scene loaded from cache \"" << scene.cache << "\"." << endl;
+    else if(!build_scene(name, n_model, mat, mngr, scn))return false;
 
 
     GlobalData data;  data.ray_count = ray_count;
-    data.group_count = group_count = align(mngr.group_count() + 1, unit_width);
+    data.group_count = group_count = align(scn.grp_count + 1, unit_width);
     cout << "Group count: " << group_count << endl;
+    if(!select_radix())return false;
+    data.key_or = 0;  data.key_and = GROUP_ID_MASK;  data.sort_passes = data.lost_hits = 0;  data.done_count[rt_primary] = data.done_count[rt_shadow] = 0;
+    data.work_next = 0;
 
     data.cam.eye.s[0] = 0;  data.cam.eye.s[1] = -0.3;  data.cam.eye.s[2] = 0;
     data.cam.top_left.s[0] = -0.5;  data.cam.top_left.s[1] = 1;  data.cam.top_left.s[2] = -0.5;
     data.cam.dx.s[0] = 1.0 / width;  data.cam.dx.s[1] = 0;  data.cam.dx.s[2] = 0;
     data.cam.dy.s[0] = 0;  data.cam.dy.s[1] = 0;  data.cam.dy.s[2] = 1.0 / height;
     data.cam.width = width;  data.cam.height = height;
-    data.cam.root_group = aabb_id;  data.cam.root_local = 0;
+    data.cam.root_group = scn.root_group;  data.cam.root_local = 0;
+    camera = data.cam;  data.cam = band_camera();
+
+    if(trace.backend != bk_opencl)
+    {
+        native.init(warp_width, area_size, data, scn, &mat[0], n_obj, trace.threads, trace.pin_threads);
+        cout << "Native tracer: " << NativeTracer::packet_width << "-wide ray packets, " <<
+            native.thread_count() << " threads" <<
+            (trace.pin_threads ? " pinned to cores." : ".") << endl;
+    }
 
-    return create_buffers(data, mngr.group(0), mat, n_obj, mngr.aabb(0), mngr.aabb_count(),
-        mngr.vertex(0), mngr.vertex_count(), mngr.triangle(0), mngr.triangle_count());
+    cout << "Scene memory: " << scn.memory_size() / 1024 << " KB total, vertices " <<
+        scn.vtx_count * sizeof(Vertex) / 1024 << " KB, AABBs " <<
+        scn.aabb_count * sizeof(AABB) / 1024 << " KB, triangles " <<
+        scn.tri_count * sizeof(cl_uint) / 1024 << " KB, triangle records " <<
+        scn.rec_count * sizeof(cl_float4) / 1024 << " KB" << endl;
+
+    if(scene.cache && !cached && SceneCache::write(scene.cache, key, scn, group_count))
+        cout << "Scene cache written to \"" << scene.cache << "\"." << endl;
+    return create_buffers(data, scn, &mat[0], n_obj, cached ? mem_use : mem_copy);  // mapped file stays valid while buffers live
 }
 
-bool RayTracer::create_buffers(GlobalData &data, Group *grp, Matrix *mat, size_t mat_count,
-    AABB *aabb, size_t aabb_count, Vertex *vtx, size_t vtx_count, cl_uint *tri, size_t tri_count)
+bool RayTracer::create_buffers(GlobalData &data, const SceneData &scn, Matrix *mat, size_t mat_count, cl_mem_flags scene_flags)
 {
     if(!create_buffer(global, "global", mem_copy, sizeof(data), &data))return false;
     if(!create_buffer(area, "area", mem_rw, area_size * sizeof(cl_float4)))return false;
-    if(!create_buffer(ray_list, "ray_list", mem_rw, ray_count * sizeof(RayQueue)))return false;
+    if(!create_buffer(ray_list, "ray_list", mem_rw, ray_count * sizeof(RayQueue)))return false;  // same size for SoA
+    if(!create_buffer(queue_list, "queue_list", mem_rw, ray_count * (MAX_QUEUE_LEN - 1) * sizeof(RayHit)))return false;
+    size_t ray_size = sizeof(RayQueue) + (MAX_QUEUE_LEN - 1) * sizeof(RayHit);
+    cout << "Ray state: " << ray_size << " bytes per ray (" << sizeof(RayQueue) << " head, " <<
+        (MAX_QUEUE_LEN - 1) * sizeof(RayHit) << " queue tail), " << ray_count * ray_size / (1 << 20) << " MB total" << endl;
     if(!create_buffer(grp_data, "grp_data", mem_rw, data.group_count * sizeof(GroupData)))return false;
+    if(!create_buffer(grp_sum, "grp_sum", mem_rw, data.group_count / unit_width * sizeof(cl_uint2)))return false;
     if(!create_buffer(ray_index[0], "ray_index[0]", mem_rw, ray_count * sizeof(cl_uint2)))return false;
     if(!create_buffer(ray_index[1], "ray_index[1]", mem_rw, ray_count * sizeof(cl_uint2)))return false;
-    if(!create_buffer(grp_list, "grp_list", mem_ro | mem_copy, group_count * sizeof(Group), grp))return false;
+    if(!create_buffer(grp_list, "grp_list", mem_ro | scene_flags, group_count * sizeof(Group), scn.grp))return false;
     if(!create_buffer(mat_list, "mat_list", mem_ro | mem_copy, mat_count * sizeof(Matrix), mat))return false;
-    if(!create_buffer(aabb_list, "aabb_list", mem_ro | mem_copy, aabb_count * sizeof(AABB), aabb))return false;
-    if(!create_buffer(vtx_list, "vtx_list", mem_ro | mem_copy, vtx_count * sizeof(Vertex), vtx))return false;
-    if(!create_buffer(tri_list, "tri_list", mem_ro | mem_copy, tri_count * sizeof(cl_uint), tri))return false;
-
+    if(!create_buffer(aabb_list, "aabb_list", mem_ro | scene_flags, scn.aabb_count * sizeof(AABB), scn.aabb))return false;
+    if(!create_buffer(vtx_list, "vtx_list", mem_ro | scene_flags, scn.vtx_count * sizeof(Vertex), scn.vtx))return false;
+    if(!create_scene_buffer(tri_list, "tri_list", scene_flags, scn.tri_count * sizeof(cl_uint), scn.tri))return false;
+    if(!create_scene_buffer(rec_list, "rec_list", scene_flags, scn.rec_count * sizeof(cl_float4), scn.rec))return false;
+
+#ifdef HEADLESS
+    if(!create_buffer(image, "image", mem_wo, area_size * sizeof(cl_float4)))return false;
+#else
     cl_int err;
     image = clCreateFromGLTexture2D(context, CL_MEM_WRITE_ONLY, GL_TEXTURE_2D, 0, texture, &err);
     if(err != CL_SUCCESS)return opencl_error("Cannot create image: ", err);
+#endif
 
     // sort
 
-    if(!create_sub_buffer(sort_count, "sort_count", global, mem_rw, offsetof(GlobalData, ray_count), sizeof(cl_uint)))return false;
+    if(!create_sub_buffer(sort_count, "sort_count", global, mem_rw, offsetof(GlobalData, ray_count), 4 * sizeof(cl_uint)))return false;  // with key_or, key_and, sort_passes
     if(!create_buffer(local_index, "local_index", mem_rw, ray_count * sizeof(cl_uint)))return false;
-    if(!create_buffer(global_index, "global_index", mem_rw, block_count * RADIX_MAX * sizeof(cl_uint)))return false;
+    if(!create_buffer(global_index, "global_index", mem_rw, (block_count + 1) * (size_t(1) << radix_shift) * sizeof(cl_uint)))return false;
     return true;
 }
 
@@ -382,6 +711,15 @@ bool RayTracer::create_kernels()
     if(!create_kernel(init_image, "init_image"))return false;
     if(!set_kernel_arg(init_image, 0, area))return false;
 
+    process_size = ray_count;
+    if(trace.persistent)
+    {
+        cl_uint units;
+        cl_int err = clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(units), &units, 0);
+        if(err != CL_SUCCESS)return opencl_error("Cannot get device compute units: ", err);
+        process_size = std::min(ray_count, units * trace.persistent * unit_width);
+        cout << "Persistent process: " << process_size / unit_width << " units." << endl;
+    }
     if(!create_kernel(process, "process"))return false;
     if(!set_kernel_arg(process, 0, global))return false;
     if(!set_kernel_arg(process, 1, area))return false;
@@ -391,18 +729,51 @@ bool RayTracer::create_kernels()
     if(!set_kernel_arg(process, 6, aabb_list))return false;
     if(!set_kernel_arg(process, 7, vtx_list))return false;
     if(!set_kernel_arg(process, 8, tri_list))return false;
+    if(!set_kernel_arg(process, 9, rec_list))return false;
+    if(!set_kernel_arg(process, 10, queue_list))return false;
 
     if(!create_kernel(count_groups, "count_groups"))return false;
     if(!set_kernel_arg(count_groups, 0, global))return false;
     if(!set_kernel_arg(count_groups, 1, grp_data))return false;
 
+    if(!create_kernel(reduce_groups, "reduce_groups"))return false;
+    if(!set_kernel_arg(reduce_groups, 0, global))return false;
+    if(!set_kernel_arg(reduce_groups, 1, grp_data))return false;
+    if(!set_kernel_arg(reduce_groups, 2, grp_sum))return false;
+    if(!set_kernel_arg(reduce_groups, 3, cl_uint(trace.bin_sort)))return false;
+
+    if(!create_kernel(scan_group_sums, "scan_group_sums"))return false;
+    if(!set_kernel_arg(scan_group_sums, 0, global))return false;
+    if(!set_kernel_arg(scan_group_sums, 1, grp_sum))return false;
+
     if(!create_kernel(update_groups, "update_groups"))return false;
     if(!set_kernel_arg(update_groups, 0, global))return false;
     if(!set_kernel_arg(update_groups, 1, grp_data))return false;
+    if(!set_kernel_arg(update_groups, 2, grp_sum))return false;
 
     if(!create_kernel(set_ray_index, "set_ray_index"))return false;
     if(!set_kernel_arg(set_ray_index, 0, global))return false;
     if(!set_kernel_arg(set_ray_index, 1, grp_data))return false;
+    if(!set_kernel_arg(set_ray_index, 4, local_index))return false;
+    if(!set_kernel_arg(set_ray_index, 5, cl_uint(trace.bin_sort)))return false;
+
+    if(!create_kernel(clear_bins, "clear_bins"))return false;
+    if(!set_kernel_arg(clear_bins, 0, grp_data))return false;
+
+    if(!create_kernel(count_bins, "count_bins"))return false;
+    if(!set_kernel_arg(count_bins, 0, global))return false;
+    if(!set_kernel_arg(count_bins, 1, grp_data))return false;
+    if(!set_kernel_arg(count_bins, 3, local_index))return false;  // ranks in group
+
+    if(!create_kernel(trace_stack, "trace_stack"))return false;
+    if(!set_kernel_arg(trace_stack, 0, global))return false;
+    if(!set_kernel_arg(trace_stack, 1, area))return false;
+    if(!set_kernel_arg(trace_stack, 2, grp_list))return false;
+    if(!set_kernel_arg(trace_stack, 3, mat_list))return false;
+    if(!set_kernel_arg(trace_stack, 4, aabb_list))return false;
+    if(!set_kernel_arg(trace_stack, 5, vtx_list))return false;
+    if(!set_kernel_arg(trace_stack, 6, tri_list))return false;
+    if(!set_kernel_arg(trace_stack, 7, rec_list))return false;
 
     if(!create_kernel(update_image, "update_image"))return false;
     if(!set_kernel_arg(update_image, 0, global))return false;
@@ -412,9 +783,9 @@ bool RayTracer::create_kernels()
     // sort
 
     if(!create_kernel(local_count, "local_count"))return false;
-    if(!set_kernel_arg(local_count, 1, sort_count))return false;
-    if(!set_kernel_arg(local_count, 2, local_index))return false;
-    if(!set_kernel_arg(local_count, 3, global_index))return false;
+    if(!set_kernel_arg(local_count, 2, sort_count))return false;
+    if(!set_kernel_arg(local_count, 3, local_index))return false;
+    if(!set_kernel_arg(local_count, 4, global_index))return false;
 
     if(!create_kernel(global_count, "global_count"))return false;
     if(!set_kernel_arg(global_count, 0, global_index))return false;
@@ -424,60 +795,267 @@ bool RayTracer::create_kernels()
     if(!set_kernel_arg(shuffle_data, 2, sort_count))return false;
     if(!set_kernel_arg(shuffle_data, 3, local_index))return false;
     if(!set_kernel_arg(shuffle_data, 4, global_index))return false;
+
+    if(!create_kernel(sort_finish, "sort_finish"))return false;
+    if(!set_kernel_arg(sort_finish, 2, sort_count))return false;
     return true;
 }
 
 
 bool RayTracer::init_frame()
 {
+    if(trace.backend != bk_opencl)native.init_frame();
+    if(trace.backend == bk_native)return true;
     if(!run_kernel(init_groups, group_count))return false;
     if(!run_kernel(init_rays, ray_count))return false;
     if(!run_kernel(init_image, area_size))return false;
-    return true;
+    trace_offset = 0;  return true;
 }
 
-bool RayTracer::make_step()
+bool RayTracer::sort_rays()  // passes of digits equal in all keys return early on device, no readback
 {
-    if(!set_kernel_arg(process, 3, ray_index[0]))return false;
-    if(!run_kernel(process, ray_count))return false;
-
-    for(cl_uint shift = 0, mask = GROUP_ID_MASK, max = group_count - 1; max;
-        shift += RADIX_SHIFT, mask >>= RADIX_SHIFT, max >>= RADIX_SHIFT)
+    const cl_uint radix_max = 1 << radix_shift, radix_mask = radix_max - 1;
+    cl_uint shift = 0;
+    for(cl_uint mask = GROUP_ID_MASK, max = group_count - 1; max;
+        shift += radix_shift, mask >>= radix_shift, max >>= radix_shift)
     {
+        const cl_uint max_val = std::min(radix_max, max + 1);
         if(!set_kernel_arg(local_count, 0, ray_index[0]))return false;
-        if(!set_kernel_arg(local_count, 4, shift))return false;
-        if(!set_kernel_arg(local_count, 5, mask & RADIX_MASK))return false;
-        if(!set_kernel_arg(local_count, 6, std::min(cl_uint(RADIX_MAX), max + 1)))return false;
+        if(!set_kernel_arg(local_count, 1, ray_index[1]))return false;
+        if(!set_kernel_arg(local_count, 5, shift))return false;
+        if(!set_kernel_arg(local_count, 6, mask & radix_mask))return false;
+        if(!set_kernel_arg(local_count, 7, max_val))return false;
         if(!run_kernel(local_count, block_count * unit_width))return false;
 
-        if(!set_kernel_arg(global_count, 2, std::min(cl_uint(RADIX_MAX), max + 1)))return false;
-        if(!run_kernel(global_count, unit_width))return false;
+        if(!set_kernel_arg(global_count, 2, shift))return false;
+        if(!set_kernel_arg(global_count, 3, mask & radix_mask))return false;
+        if(!run_kernel(global_count, max_val * unit_width))return false;
 
         if(!set_kernel_arg(shuffle_data, 0, ray_index[0]))return false;
         if(!set_kernel_arg(shuffle_data, 1, ray_index[1]))return false;
         if(!set_kernel_arg(shuffle_data, 5, shift))return false;
-        if(!set_kernel_arg(shuffle_data, 6, mask & RADIX_MASK))return false;
-        if(!set_kernel_arg(shuffle_data, 7, max < (1 << RADIX_SHIFT)))return false;
+        if(!set_kernel_arg(shuffle_data, 6, mask & radix_mask))return false;
+        if(!set_kernel_arg(shuffle_data, 7, max_val))return false;
         if(!run_kernel(shuffle_data, block_count * unit_width))return false;
         swap(ray_index[0].value(), ray_index[1].value());
     }
+    if(!set_kernel_arg(sort_finish, 0, ray_index[0]))return false;  // odd skipped passes leave data in other buffer
+    if(!set_kernel_arg(sort_finish, 1, ray_index[1]))return false;
+    if(!set_kernel_arg(sort_finish, 3, shift))return false;
+    if(!run_kernel(sort_finish, ray_count))return false;
     if(!set_kernel_arg(count_groups, 2, ray_index[0]))return false;
-    if(!run_kernel(count_groups, ray_count))return false;
+    return run_kernel(count_groups, ray_count);
+}
+
+bool RayTracer::bin_rays()
+{
+    if(!run_kernel(clear_bins, group_count))return false;
+    if(!set_kernel_arg(count_bins, 2, ray_index[0]))return false;
+    return run_kernel(count_bins, ray_count);
+}
+
+bool RayTracer::trace_step()
+{
+    nsec_type start = get_time();
+    if(!set_kernel_arg(trace_stack, 8, trace_offset))return false;
+    if(!run_kernel(trace_stack, ray_count))return false;
+    cl_int err = clFinish(queue);  if(err != CL_SUCCESS)return opencl_error("Cannot finish step: ", err);
+    trace_time += get_time() - start;  step_count++;  trace_offset += ray_count;  return collect_profile();
+}
 
-    if(!run_kernel(update_groups, unit_width))return false;
+void RayTracer::native_step()
+{
+    nsec_type start = get_time();  native.process();
+    nsec_type mid = get_time();  native.sort();
+    if(trace.backend != bk_native)return;  // OpenCL timing in check mode
+    trace_time += mid - start;  sort_time += get_time() - mid;  step_count++;
+}
+
+bool RayTracer::make_step()
+{
+    if(trace.backend != bk_opencl)native_step();
+    if(trace.backend == bk_native)return true;
+    if(trace.stack_traversal)return trace_step();
+
+    nsec_type start = get_time(), mid = 0;  cl_event evt = 0;  // process time from event if profiling, else host sync
+    if(!set_kernel_arg(process, 3, ray_index[0]))return false;
+    if(!run_kernel(process, process_size, trace.profile ? &evt : 0))return false;
+    if(!trace.profile)
+    {
+        cl_int err = clFinish(queue);  if(err != CL_SUCCESS)return opencl_error("Cannot finish step: ", err);
+        mid = get_time();
+    }
+
+    if(!(trace.bin_sort ? bin_rays() : sort_rays()))return false;
+    if(!run_kernel(reduce_groups, group_count))return false;
+    if(!run_kernel(scan_group_sums, unit_width))return false;
+    if(!run_kernel(update_groups, group_count))return false;
 
     if(!set_kernel_arg(set_ray_index, 2, ray_index[0]))return false;
     if(!set_kernel_arg(set_ray_index, 3, ray_index[1]))return false;
     if(!run_kernel(set_ray_index, ray_count))return false;
     swap(ray_index[0].value(), ray_index[1].value());
 
+    cl_int err = clFinish(queue);
+    if(err != CL_SUCCESS)
+    {
+        if(evt)clReleaseEvent(evt);  return opencl_error("Cannot finish step: ", err);
+    }
+    nsec_type total = get_time() - start, process_time = mid - start;
+    if(evt)
+    {
+        cl_ulong begin, end;
+        err = clGetEventProfilingInfo(evt, CL_PROFILING_COMMAND_START, sizeof(begin), &begin, 0);
+        if(err == CL_SUCCESS)err = clGetEventProfilingInfo(evt, CL_PROFILING_COMMAND_END, sizeof(end), &end, 0);
+        clReleaseEvent(evt);  if(err != CL_SUCCESS)return opencl_error("Cannot get profiling info: ", err);
+        process_time = std::min(nsec_type(end - begin), total);
+    }
+    trace_time += process_time;  sort_time += total - process_time;  step_count++;
+
     //if(!debug_print())return false;  // DEBUG
     //if(!check_sorting(GROUP_ID_MASK))return false;  // DEBUG
+    return collect_profile();
+}
+
+bool RayTracer::profile_report()
+{
+    if(trace.backend != bk_opencl)native.print_utilization();
+    if(!trace.profile)return true;
+    cl_int err = clFinish(queue);  if(err != CL_SUCCESS)return opencl_error("Cannot finish queue: ", err);
+    if(!collect_profile())return false;
+
+    bool csv = strcmp(trace.profile, "print");  FILE *output = csv ? fopen(trace.profile, "w") : stdout;
+    if(!output)
+    {
+        cout << "Cannot open file \"" << trace.profile << "\"!" << endl;  return false;
+    }
+    fprintf(output, csv ? "kernel,count,total_ms,mean_us,p95_us\n" :
+        "Kernel              count    total, ms    mean, us     p95, us\n");
+    for(size_t i = 0; i < kernel_list.size(); i++)
+    {
+        vector<cl_ulong> &time = kernel_list[i]->time;  if(time.empty())continue;
+        cl_ulong total = 0;  for(size_t j = 0; j < time.size(); j++)total += time[j];
+        size_t k = time.size() * 95 / 100;  nth_element(time.begin(), time.begin() + k, time.end());
+        fprintf(output, csv ? "%s,%zu,%.3f,%.3f,%.3f\n" : "%-16s %8zu %12.3f %12.3f %12.3f\n", kernel_list[i]->name,
+            time.size(), 1e-6 * total, 1e-3 * total / time.size(), 1e-3 * time[k]);
+    }
+    if(!csv)return true;
+    if(fclose(output))
+    {
+        cout << "Cannot write file \"" << trace.profile << "\"!" << endl;  return false;
+    }
+    cout << "Kernel profile written to \"" << trace.profile << "\"." << endl;  return true;
+}
+
+bool RayTracer::sync_native()  // upload native image or compare with it
+{
+    if(trace.backend == bk_opencl)return true;
+    if(trace.backend == bk_native)
+    {
+        cl_int err = clEnqueueWriteBuffer(queue, area, CL_TRUE, 0, area_size * sizeof(cl_float4), native.area_data(), 0, 0, 0);
+        if(err != CL_SUCCESS)return opencl_error("Cannot write buffer data: ", err);  return true;
+    }
+
+    cl_float4 *buf = new cl_float4[area_size];
+    cl_int err = clEnqueueReadBuffer(queue, area, CL_TRUE, 0, area_size * sizeof(cl_float4), buf, 0, 0, 0);
+    if(err != CL_SUCCESS)
+    {
+        delete [] buf;  return opencl_error("Cannot read buffer data: ", err);
+    }
+    const cl_float4 *ref = native.area_data();  double sum = 0, max_err = 0;  size_t diff_count = 0;
+    for(size_t i = 0; i < area_size; i++)
+    {
+        double err = 0;
+        for(int k = 0; k < 3; k++)
+            err = max(err, fabs(buf[i].s[k] / (buf[i].s[3] + 1e-6) - ref[i].s[k] / (ref[i].s[3] + 1e-6)));
+        sum += err;  max_err = max(max_err, err);  if(err > 1.0 / 256)diff_count++;
+    }
+    delete [] buf;
+    cout << "Native check: rays " << current_ray() << " OpenCL, " << native.global_data().pixel_offset <<
+        " native; pixel error mean " << sum / area_size << ", max " << max_err << ", " << diff_count << " pixels above 1/256." << endl;
+
+    const double max_tolerance = 1.0 / 8, diff_tolerance = 0.01;  // sampling order may differ, rare outliers allowed
+    if(max_err <= max_tolerance && diff_count <= diff_tolerance * area_size)return true;
+    cout << "Native check failed: tolerance is max error " << max_tolerance << " and " <<
+        100 * diff_tolerance << "% pixels above 1/256!" << endl;  return false;
+}
+
+#ifdef HEADLESS
+bool write_image(const char *file, const cl_float4 *buf, size_t width, size_t height)  // normalized colors
+{
+    FILE *output = fopen(file, "wb");
+    if(!output)
+    {
+        cout << "Cannot open file \"" << file << "\"!" << endl;  return false;
+    }
+
+    size_t len = strlen(file);  bool res;
+    if(len >= 4 && !strcmp(file + len - 4, ".pfm"))  // linear, bottom-to-top rows
+    {
+        fprintf(output, "PF\n%zu %zu\n-1.0\n", width, height);  res = true;
+        for(size_t i = 0; i < width * height && res; i++)res = fwrite(buf[i].s, sizeof(cl_float), 3, output) == 3;
+    }
+    else  // gamma-corrected, top-to-bottom rows
+    {
+        fprintf(output, "P6\n%zu %zu\n255\n", width, height);
+        unsigned char *line = new unsigned char[3 * width];  res = true;
+        for(size_t y = height; y-- > 0 && res;)
+        {
+            for(size_t x = 0; x < width; x++)for(int k = 0; k < 3; k++)
+            {
+                cl_float val = pow(max(0.0f, buf[y * width + x].s[k]), 1 / 2.2f);
+                line[3 * x + k] = val < 1 ? int(255 * val + 0.5f) : 255;
+            }
+            res = fwrite(line, 3, width, output) == width;
+        }
+        delete [] line;
+    }
+    if(fclose(output) || !res)
+    {
+        cout << "Cannot write file \"" << file << "\"!" << endl;  return false;
+    }
     return true;
 }
 
 bool RayTracer::draw_frame()
 {
+    if(!sync_native())return false;
+    return run_kernel(update_image, area_size);
+}
+
+bool RayTracer::save_frame(const char *file)
+{
+    cl_float4 *buf = new cl_float4[area_size];
+    cl_int err = clEnqueueReadBuffer(queue, image, CL_TRUE, 0, area_size * sizeof(cl_float4), buf, 0, 0, 0);
+    if(err != CL_SUCCESS)
+    {
+        delete [] buf;  return opencl_error("Cannot read image data: ", err);
+    }
+    bool res = write_image(file, buf, width, height);  delete [] buf;  return res;
+}
+
+bool RayTracer::set_band(size_t begin, size_t rows)
+{
+    band_begin = begin;  band_rows = rows;  if(!global)return true;  // before init
+    Camera cam = band_camera();  if(trace.backend != bk_opencl)native.set_camera(cam);
+    cl_int err = clEnqueueWriteBuffer(queue, global, CL_TRUE, offsetof(GlobalData, cam), sizeof(cam), &cam, 0, 0, 0);
+    if(err != CL_SUCCESS)return opencl_error("Cannot write buffer data: ", err);  return true;
+}
+
+bool RayTracer::read_area(cl_float4 *buf)
+{
+    size_t size = width * band_rows * sizeof(cl_float4);
+    if(trace.backend == bk_native)
+    {
+        memcpy(buf, native.area_data(), size);  return true;
+    }
+    cl_int err = clEnqueueReadBuffer(queue, area, CL_TRUE, 0, size, buf, 0, 0, 0);
+    if(err != CL_SUCCESS)return opencl_error("Cannot read buffer data: ", err);  return true;
+}
+#else
+bool RayTracer::draw_frame()
+{
+    if(!sync_native())return false;
     glFinish();
     cl_int err = clEnqueueAcquireGLObjects(queue, 1, &image.value(), 0, 0, 0);
     if(err != CL_SUCCESS)return opencl_error("Cannot acquire image from OpenGL: ", err);
@@ -488,10 +1066,470 @@ bool RayTracer::draw_frame()
     if(err != CL_SUCCESS)return opencl_error("Cannot release image to OpenGL: ", err);
     glFinish();  return true;
 }
+#endif
+
+
+
+const char *get_option(int n, const char **arg, const char *name, const char *def)
+{
+    size_t len = strlen(name);
+    for(int i = 2; i < n; i++)
+        if(!strncmp(arg[i], name, len) && arg[i][len] == '=')return arg[i] + len + 1;
+    return def;
+}
+
+bool parse_settings(int n, const char **arg, BuildSettings &build, TraceSettings &trace, SceneSettings &scene)
+{
+    scene.models = get_option(n, arg, "models", scene.models);
+    for(size_t i = 0, count = 1; scene.models[i]; i++)if(scene.models[i] == ',' && ++count > SceneSettings::max_models)
+    {
+        cout << "Too many models!" << endl;  return false;
+    }
+    scene.instance_count = atoi(get_option(n, arg, "instances", "256"));
+    if(!scene.instance_count)
+    {
+        cout << "Invalid instance count!" << endl;  return false;
+    }
+    scene.seed = atoi(get_option(n, arg, "seed", "1"));
+    scene.device = atoi(get_option(n, arg, "device", "0"));
+    scene.cache = get_option(n, arg, "scene_cache", 0);
+
+    const char *backend = get_option(n, arg, "backend", "opencl");
+    if(!strcmp(backend, "native"))trace.backend = bk_native;
+    else if(!strcmp(backend, "check"))trace.backend = bk_check;
+    else if(strcmp(backend, "opencl"))
+    {
+        cout << "Invalid backend \"" << backend << "\"!" << endl;  return false;
+    }
+
+    const char *layout = get_option(n, arg, "ray_layout", "aos");
+    if(!strcmp(layout, "soa"))trace.ray_soa = true;
+    else if(strcmp(layout, "aos"))
+    {
+        cout << "Invalid ray layout \"" << layout << "\"!" << endl;  return false;
+    }
+
+    const char *radix = get_option(n, arg, "radix", "auto");
+    if(strcmp(radix, "auto"))
+    {
+        trace.radix_shift = atoi(radix);
+        if(trace.radix_shift < 1 || trace.radix_shift > 8)
+        {
+            cout << "Invalid radix width \"" << radix << "\"!" << endl;  return false;
+        }
+    }
+
+    const char *traversal = get_option(n, arg, "traversal", "wavefront");
+    if(!strcmp(traversal, "stack"))trace.stack_traversal = true;
+    else if(strcmp(traversal, "wavefront"))
+    {
+        cout << "Invalid traversal mode \"" << traversal << "\"!" << endl;  return false;
+    }
+
+    trace.threads = atoi(get_option(n, arg, "threads", "0"));
+    trace.pin_threads = atoi(get_option(n, arg, "pin", "0"));
+    if(trace.stack_traversal && trace.backend != bk_opencl)
+    {
+        cout << "Native backend supports wavefront traversal only!" << endl;  return false;
+    }
+
+    trace.persistent = atoi(get_option(n, arg, "persistent", "0"));
+    trace.profile = get_option(n, arg, "profile", 0);
+    trace.program_cache = get_option(n, arg, "program_cache", 0);
+
+    const char *sort = get_option(n, arg, "sort", "radix");
+    if(!strcmp(sort, "bin"))trace.bin_sort = true;
+    else if(strcmp(sort, "radix"))
+    {
+        cout << "Invalid sort mode \"" << sort << "\"!" << endl;  return false;
+    }
+
+    const char *builder = get_option(n, arg, "builder", "median");
+    if(!strcmp(builder, "sah"))build.sah = true;
+    else if(strcmp(builder, "median"))
+    {
+        cout << "Invalid builder \"" << builder << "\"!" << endl;  return false;
+    }
+    build.bin_count = atoi(get_option(n, arg, "bins", "16"));
+    build.leaf_cost = atof(get_option(n, arg, "leaf_cost", "1"));
+    build.traversal_cost = atof(get_option(n, arg, "traversal_cost", "64"));
+    build.tri_threshold = atoi(get_option(n, arg, "tri_threshold", "128"));
+    if(build.tri_threshold < 2)
+    {
+        cout << "Invalid triangle threshold!" << endl;  return false;
+    }
+    build.aabb_threshold = atoi(get_option(n, arg, "aabb_threshold", "128"));
+    if(build.aabb_threshold < 1)
+    {
+        cout << "Invalid AABB threshold!" << endl;  return false;
+    }
+    const char *fanout = get_option(n, arg, "fanout", 0);  if(fanout)build.max_fanout = atoi(fanout);
+    if(build.max_fanout == 1)
+    {
+        cout << "Invalid group fanout!" << endl;  return false;
+    }
+    if(!build.max_fanout || build.max_fanout > MAX_HITS)  // overlapping children past MAX_HITS would be lost
+    {
+        cout << "Group fanout limited to " << MAX_HITS << "." << endl;  build.max_fanout = MAX_HITS;
+    }
+    const char *aabb_format = get_option(n, arg, "aabb_format", "float");
+    if(!strcmp(aabb_format, "quant8"))build.quantize = true;
+    else if(strcmp(aabb_format, "float"))
+    {
+        cout << "Invalid AABB format \"" << aabb_format << "\"!" << endl;  return false;
+    }
+    static const char *formats[] = {"packed", "wide", "record", "record_norm"};
+    const char *format = get_option(n, arg, "tri_format", "packed");
+    for(int i = 0;; i++)
+    {
+        if(i == 4)
+        {
+            cout << "Invalid triangle format \"" << format << "\"!" << endl;  return false;
+        }
+        if(strcmp(format, formats[i]))continue;
+        build.tri_format = TriangleFormat(tf_packed + i);  break;
+    }
+    if(!mesh_indices_fit(build.tri_threshold - 1, build.tri_format))
+    {
+        cout << "Triangle threshold too large for " << MESH_WIDE_INDEX_BITS << "-bit indices!" << endl;  return false;
+    }
+    return true;
+}
+
+void print_step_time(const StepTime &time)
+{
+    if(!time.steps)return;
+    cout << "Per step: trace " << time.trace << " ms, sort " << time.sort << " ms, " <<
+        time.passes << " radix passes, " << 1e3 / (time.trace + time.sort) << " steps/s." << endl;
+    if(time.lost)cout << "Warning: " << time.lost << " AABB hits lost to group overflow!" << endl;
+}
+
+bool parse_frame(int n, const char **arg, int &width, int &height, int &ray_count, int &step_count)
+{
+    width = atoi(get_option(n, arg, "width", "1024"));  height = atoi(get_option(n, arg, "height", "1024"));
+    ray_count = atoi(get_option(n, arg, "rays", "1048576"));  step_count = atoi(get_option(n, arg, "steps", "32"));
+    if(width > 0 && height > 0 && ray_count > 0 && step_count > 0)return true;
+    cout << "Invalid frame settings!" << endl;  return false;
+}
 
+#ifdef HEADLESS
+bool check_pattern(const char *str)  // printf format with at most one integer conversion for frame number
+{
+    for(int count = 0; *str; str++)
+    {
+        if(*str != '%' || *++str == '%')continue;
+        while(*str == '0' || *str == '-' || *str == '+' || *str == ' ')str++;
+        while(*str >= '0' && *str <= '9')str++;
+        if(*str != 'd' && *str != 'i' || count++)return false;
+    }
+    return true;
+}
 
+struct FrameStat
+{
+    int frame;  double time;  cl_uint rays, primary, shadow;  StepTime step;
+};
 
-bool ray_tracer(cl_platform_id platform)
+bool write_report(const char *file, const FrameStat *stat, size_t count)
+{
+    FILE *output = fopen(file, "w");
+    if(!output)
+    {
+        cout << "Cannot open file \"" << file << "\"!" << endl;  return false;
+    }
+    fprintf(output, "frame,time_s,rays,mrays_s,primary_mrays_s,shadow_mrays_s,steps,trace_ms,sort_ms,radix_passes,lost_hits\n");
+    FrameStat total = {-1, 0, 0, 0, 0, {0, 0, 0, 0, 0}};
+    for(size_t i = 0; i <= count; i++)
+    {
+        const FrameStat &cur = i < count ? stat[i] : total;
+        if(i < count)fprintf(output, "%d,", cur.frame);  else fprintf(output, "total,");
+        fprintf(output, "%.6f,%u,%.3f,%.3f,%.3f,%zu,%.3f,%.3f,%.3f,%u\n", cur.time, cur.rays, 1e-6 * cur.rays / cur.time,
+            1e-6 * cur.primary / cur.time, 1e-6 * cur.shadow / cur.time, cur.step.steps, cur.step.trace, cur.step.sort, cur.step.passes, cur.step.lost);
+        if(i == count)break;
+
+        size_t steps = total.step.steps + cur.step.steps;  // per-step values weighted by step count
+        total.step.trace = (total.step.trace * total.step.steps + cur.step.trace * cur.step.steps) / steps;
+        total.step.sort = (total.step.sort * total.step.steps + cur.step.sort * cur.step.steps) / steps;
+        total.step.passes = (total.step.passes * total.step.steps + cur.step.passes * cur.step.steps) / steps;
+        total.step.steps = steps;  total.step.lost += cur.step.lost;  total.time += cur.time;  total.rays += cur.rays;
+        total.primary += cur.primary;  total.shadow += cur.shadow;
+    }
+    if(fclose(output))
+    {
+        cout << "Cannot write file \"" << file << "\"!" << endl;  return false;
+    }
+    cout << "Benchmark report written to \"" << file << "\"." << endl;  return true;
+}
+
+struct DeviceRef
+{
+    cl_platform_id platform;  cl_uint index;
+};
+
+bool parse_devices(const char *spec, const cl_platform_id *platform, cl_uint platform_count, cl_uint index, vector<DeviceRef> &list)
+{
+    if(!strcmp(spec, "all"))
+    {
+        for(cl_uint i = 0; i < platform_count; i++)
+        {
+            cl_uint count;  cl_int err = clGetDeviceIDs(platform[i], CL_DEVICE_TYPE_ALL, 0, 0, &count);
+            if(err == CL_DEVICE_NOT_FOUND)continue;  if(err != CL_SUCCESS)return opencl_error("Cannot get device list: ", err);
+            for(cl_uint j = 0; j < count; j++)
+            {
+                DeviceRef ref = {platform[i], j};  list.push_back(ref);
+            }
+        }
+        if(!list.empty())return true;
+        cout << "No devices found!" << endl;  return false;
+    }
+
+    char buf[1024];  snprintf(buf, sizeof(buf), "%s", spec);
+    for(char *ptr = strtok(buf, ","); ptr; ptr = strtok(0, ","))  // [platform:]device, default -- program argument
+    {
+        char *end;  cl_uint val = strtoul(ptr, &end, 10);  DeviceRef ref = {platform[index], val};
+        if(end != ptr && *end == ':' && val < platform_count)
+        {
+            ref.platform = platform[val];  ref.index = strtoul(ptr = end + 1, &end, 10);
+        }
+        if(end != ptr && !*end)
+        {
+            list.push_back(ref);  continue;
+        }
+        cout << "Invalid device \"" << ptr << "\"!" << endl;  return false;
+    }
+    if(!list.empty())return true;
+    cout << "Empty device list!" << endl;  return false;
+}
+
+class MultiTracer  // image rows split between devices, rebalanced by measured throughput
+{
+    struct Device
+    {
+        RayTracer *tracer;  size_t begin, rows;
+        cl_uint rays, done[2];  double rate;  bool ok;  // last frame
+    };
+
+    size_t width, height;  vector<Device> device;
+    vector<cl_float4> accum;  // area of previous bands
+    cl_uint total_ray, total_done[2];
+
+    static void run_device(Device &dev, int step_count, atomic<bool> &stop);
+    bool add_area(vector<cl_float4> &res);
+    bool rebalance();
+
+public:
+    MultiTracer(size_t width_, size_t height_) : width(width_), height(height_), total_ray(0)
+    {
+        total_done[rt_primary] = total_done[rt_shadow] = 0;
+    }
+
+    ~MultiTracer()
+    {
+        for(size_t i = 0; i < device.size(); i++)delete device[i].tracer;
+    }
+
+    bool init(const vector<DeviceRef> &list, size_t ray_count,
+        const BuildSettings &build, const TraceSettings &trace, const SceneSettings &scene);
+    bool init_frame();
+    bool make_frame(int step_count);  // all devices run until first one makes step_count steps
+    StepTime step_time();
+    bool save_frame(const char *file);
+    bool profile_report();
+
+    cl_uint current_ray(cl_uint *done)
+    {
+        done[rt_primary] = total_done[rt_primary];  done[rt_shadow] = total_done[rt_shadow];  return total_ray;
+    }
+};
+
+bool MultiTracer::init(const vector<DeviceRef> &list, size_t ray_count,
+    const BuildSettings &build, const TraceSettings &trace, const SceneSettings &scene)
+{
+    if(list.size() > height)
+    {
+        cout << "More devices than image rows!" << endl;  return false;
+    }
+    for(size_t i = 0; i < list.size(); i++)
+    {
+        if(list.size() > 1)cout << "Tracer " << i << ", rows " << height * i / list.size() << "-" << height * (i + 1) / list.size() - 1 << ":" << endl;
+        SceneSettings cur = scene;  cur.device = list[i].index;
+        Device dev = {new RayTracer(width, height, ray_count, build, trace, cur),
+            height * i / list.size(), height * (i + 1) / list.size() - height * i / list.size(), 0, {0, 0}, 0, true};
+        device.push_back(dev);  dev.tracer->set_band(dev.begin, dev.rows);
+        if(!dev.tracer->init(list[i].platform))return false;
+    }
+    cl_float4 zero;  memset(&zero, 0, sizeof(zero));  accum.assign(width * height, zero);  return true;
+}
+
+bool MultiTracer::init_frame()
+{
+    for(size_t i = 0; i < device.size(); i++)if(!device[i].tracer->init_frame())return false;
+    return true;
+}
+
+void MultiTracer::run_device(Device &dev, int step_count, atomic<bool> &stop)
+{
+    cl_uint old_ray = 0, old_done[2] = {0, 0}, cur_ray = 0, done[2] = {0, 0};
+    nsec_type start = get_time();  dev.ok = dev.tracer->read_counters(old_ray, old_done);
+    for(int i = 0; i < step_count && !stop && dev.ok; i++)dev.ok = dev.tracer->make_step();
+    stop = true;  dev.ok = dev.ok && dev.tracer->draw_frame() && dev.tracer->read_counters(cur_ray, done);
+
+    dev.rays = cur_ray - old_ray;
+    dev.done[rt_primary] = done[rt_primary] - old_done[rt_primary];
+    dev.done[rt_shadow] = done[rt_shadow] - old_done[rt_shadow];
+    dev.rate = dev.rays / ((get_time() - start) * 1e-9);
+}
+
+bool MultiTracer::make_frame(int step_count)
+{
+    atomic<bool> stop(false);  vector<thread> worker;
+    for(size_t i = 1; i < device.size(); i++)worker.push_back(thread(run_device, ref(device[i]), step_count, ref(stop)));
+    run_device(device[0], step_count, stop);
+    for(size_t i = 0; i < worker.size(); i++)worker[i].join();
+
+    for(size_t i = 0; i < device.size(); i++)
+    {
+        if(!device[i].ok)return false;  total_ray += device[i].rays;
+        total_done[rt_primary] += device[i].done[rt_primary];  total_done[rt_shadow] += device[i].done[rt_shadow];
+    }
+    return rebalance();
+}
+
+bool MultiTracer::add_area(vector<cl_float4> &res)
+{
+    vector<cl_float4> buf(width * height);
+    for(size_t i = 0; i < device.size(); i++)
+    {
+        if(!device[i].tracer->read_area(&buf[0]))return false;
+        cl_float4 *dst = &res[device[i].begin * width];
+        for(size_t j = 0; j < device[i].rows * width; j++)for(int k = 0; k < 4; k++)dst[j].s[k] += buf[j].s[k];
+    }
+    return true;
+}
+
+bool MultiTracer::rebalance()  // rows proportional to rate, new bands restart accumulation
+{
+    double total = 0;  for(size_t i = 0; i < device.size(); i++)total += device[i].rate;
+    if(device.size() < 2 || !(total > 0))return true;
+
+    const size_t n = device.size();  vector<size_t> begin(n + 1);  double sum = 0;  size_t change = 0;
+    for(size_t i = 0; i < n; sum += device[i++].rate)
+        begin[i] = std::max(i ? begin[i - 1] + 1 : 0, std::min(height - (n - i), size_t(height * sum / total + 0.5)));
+    begin[n] = height;
+    for(size_t i = 0; i < n; i++)change = std::max(change, begin[i] > device[i].begin ? begin[i] - device[i].begin : device[i].begin - begin[i]);
+    if(20 * change < height)return true;  // within 5%, keep accumulating
+
+    if(!add_area(accum))return false;
+    cout << "Rebalanced rows:";
+    for(size_t i = 0; i < n; i++)
+    {
+        Device &dev = device[i];  dev.begin = begin[i];  dev.rows = begin[i + 1] - begin[i];
+        if(!dev.tracer->set_band(dev.begin, dev.rows) || !dev.tracer->init_frame())return false;
+        cout << (i ? ", " : " ") << dev.rows << " (" << 1e-6 * dev.rate << " MR/s)";
+    }
+    cout << endl;  return true;
+}
+
+StepTime MultiTracer::step_time()  // step count summed, per-step values weighted by it
+{
+    StepTime res = {0, 0, 0, 0, 0};
+    for(size_t i = 0; i < device.size(); i++)
+    {
+        StepTime cur = device[i].tracer->step_time();  res.steps += cur.steps;  res.lost += cur.lost;
+        res.trace += cur.trace * cur.steps;  res.sort += cur.sort * cur.steps;  res.passes += cur.passes * cur.steps;
+    }
+    if(res.steps)
+    {
+        res.trace /= res.steps;  res.sort /= res.steps;  res.passes /= res.steps;
+    }
+    return res;
+}
+
+bool MultiTracer::save_frame(const char *file)
+{
+    if(device.size() == 1)return device[0].tracer->save_frame(file);
+
+    vector<cl_float4> image(accum);  if(!add_area(image))return false;
+    for(size_t i = 0; i < image.size(); i++)
+    {
+        cl_float w = image[i].s[3] + 1e-6;  for(int k = 0; k < 4; k++)image[i].s[k] /= w;  // same as update_image
+    }
+    return write_image(file, &image[0], width, height);
+}
+
+bool MultiTracer::profile_report()
+{
+    for(size_t i = 0; i < device.size(); i++)
+    {
+        if(device.size() > 1)cout << "Tracer " << i << ":" << endl;
+        if(!device[i].tracer->profile_report())return false;
+    }
+    return true;
+}
+
+bool ray_tracer(const cl_platform_id *platform, cl_uint platform_count, cl_uint index, int n, const char **arg)
+{
+    int width, height, ray_count, step_count;  if(!parse_frame(n, arg, width, height, ray_count, step_count))return false;
+    const int warmup_count = atoi(get_option(n, arg, "warmup", "0")), frame_count = atoi(get_option(n, arg, "frames", "1"));
+    const char *output = get_option(n, arg, "output", 0), *report = get_option(n, arg, "report", 0);
+    const double min_rate = atof(get_option(n, arg, "min_rate", "0"));
+    if(output && !check_pattern(output))
+    {
+        cout << "Invalid output pattern, only one %d for frame number allowed!" << endl;  return false;
+    }
+
+    BuildSettings build;  TraceSettings trace;  SceneSettings scene;
+    if(!parse_settings(n, arg, build, trace, scene))return false;
+    vector<DeviceRef> list;  const char *devices = get_option(n, arg, "devices", 0);
+    if(devices)
+    {
+        if(!parse_devices(devices, platform, platform_count, index, list))return false;
+    }
+    else
+    {
+        DeviceRef ref = {platform[index], scene.device};  list.push_back(ref);
+    }
+    MultiTracer ray_tracer(width, height);
+    if(!ray_tracer.init(list, ray_count, build, trace, scene))return false;
+    cout << "Ready." << endl;
+
+    if(!ray_tracer.init_frame())return false;
+
+    cl_uint cur_ray = 0, done[2] = {0, 0};  vector<FrameStat> stat;  nsec_type total = 0;  cl_uint total_ray = 0;
+    cout << setprecision(3) << fixed;
+    for(int frame = -warmup_count; frame < frame_count; frame++)
+    {
+        nsec_type start = get_time();  cl_uint old_ray = cur_ray, old_done[2] = {done[0], done[1]};
+        if(!ray_tracer.make_frame(step_count))return false;
+
+        nsec_type delta = get_time() - start;  cur_ray = ray_tracer.current_ray(done);
+        StepTime time = ray_tracer.step_time();
+        if(frame < 0)
+        {
+            cout << "Warm-up frame ready in " << delta * 1e-9 << " s." << endl;  continue;
+        }
+        FrameStat cur = {frame, delta * 1e-9, cur_ray - old_ray,
+            done[rt_primary] - old_done[rt_primary], done[rt_shadow] - old_done[rt_shadow], time};
+        stat.push_back(cur);  total += delta;  total_ray += cur.rays;
+
+        cout << "Frame " << frame << " ready in " << cur.time << " s, " << cur.rays << " rays, " <<
+            1e3 * cur.rays / delta << " MR/s."<< endl;
+        cout << "Finished rays: primary " << 1e3 * cur.primary / delta << " MR/s, shadow " <<
+            1e3 * cur.shadow / delta << " MR/s." << endl;
+        print_step_time(time);
+
+        if(!output)continue;  char file[1024];
+        snprintf(file, sizeof(file), output, frame);
+        if(!ray_tracer.save_frame(file))return false;
+    }
+    if(total)cout << "Total: " << total * 1e-9 << " s, " << total_ray << " rays, " << 1e3 * total_ray / total << " MR/s." << endl;
+    if(report && !stat.empty() && !write_report(report, &stat[0], stat.size()))return false;
+    if(!ray_tracer.profile_report())return false;
+    if(!(min_rate > 0) || total && 1e3 * total_ray / total >= min_rate)return true;
+    cout << "Performance below threshold of " << min_rate << " MR/s!" << endl;  return false;
+}
+#else
+bool ray_tracer(cl_platform_id platform, int n, const char **arg)
 {
     /*if(SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3) ||
         SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 2))
@@ -507,13 +1545,14 @@ bool ray_tracer(cl_platform_id platform)
     GLContext context = SDL_GL_CreateContext(window);
     if(*SDL_GetError())return sdl_error("Cannot create OpenGL context: ");*/
 
-    const int width = 1024, height = 1024;
+    int width, height, ray_count, step_count;  if(!parse_frame(n, arg, width, height, ray_count, step_count))return false;
     SDL_Surface *surface = SDL_SetVideoMode(width, height, 0, SDL_HWSURFACE | SDL_OPENGL);
     if(!surface)return sdl_error("Cannot create OpenGL context: ");
     SDL_WM_SetCaption("RayTracer 1.0", 0);
 
-    const int repeat_count = 32;
-    RayTracer ray_tracer(width, height, 1024 * 1024);
+    BuildSettings build;  TraceSettings trace;  SceneSettings scene;
+    if(!parse_settings(n, arg, build, trace, scene))return false;
+    RayTracer ray_tracer(width, height, ray_count, build, trace, scene);
     if(!ray_tracer.init(platform))return false;
     glViewport(0, 0, width, height);
     cout << "Ready." << endl;
@@ -521,23 +1560,26 @@ bool ray_tracer(cl_platform_id platform)
     if(!ray_tracer.init_frame())return false;
     if(!ray_tracer.draw_frame())return false;
 
-    cl_uint cur_ray = 0;
+    cl_uint cur_ray = 0, done[2] = {0, 0};
     cout << setprecision(3) << fixed;
     for(SDL_Event evt;;)
     {
         SDL_WaitEvent(&evt);
         switch(evt.type)
         {
-        case SDL_QUIT:  return true;
+        case SDL_QUIT:  return ray_tracer.profile_report();
         case SDL_MOUSEBUTTONDOWN:
             {
-                nsec_type start = get_time();  cl_uint old_ray = cur_ray;
-                for(int i = 0; i < repeat_count; i++)if(!ray_tracer.make_step())return false;
+                nsec_type start = get_time();  cl_uint old_ray = cur_ray, old_done[2] = {done[0], done[1]};
+                for(int i = 0; i < step_count; i++)if(!ray_tracer.make_step())return false;
                 if(!ray_tracer.draw_frame())return false;
 
-                double delta = (get_time() - start) * 1e-9;  cur_ray = ray_tracer.current_ray();
+                double delta = (get_time() - start) * 1e-9;  cur_ray = ray_tracer.current_ray(done);
                 cout << "Frame ready in " << delta << " s, " << (cur_ray - old_ray) << " rays, " <<
                     1e-6 * (cur_ray - old_ray) / delta << " MR/s."<< endl;
+                cout << "Finished rays: primary " << 1e-6 * (done[rt_primary] - old_done[rt_primary]) / delta <<
+                    " MR/s, shadow " << 1e-6 * (done[rt_shadow] - old_done[rt_shadow]) / delta << " MR/s." << endl;
+                print_step_time(ray_tracer.step_time());
             }
         case SDL_VIDEOEXPOSE:  break;
         default:  continue;
@@ -551,6 +1593,7 @@ bool ray_tracer(cl_platform_id platform)
         glEnd();  SDL_GL_SwapBuffers();
     }
 }
+#endif
 
 
 int main(int n, const char **arg)
@@ -571,7 +1614,23 @@ int main(int n, const char **arg)
             if(err != CL_SUCCESS)return opencl_error("Cannot get platform info: ", err);
             cout << "Platform " << i << ": " << buf << endl;
         }
-        cout << "Rerun program with platform argument." << endl;  return 0;
+        cout << "Rerun program with platform argument." << endl;
+        cout << "Frame: width=<pixels> height=<pixels> rays=<count> steps=<count per frame>." << endl;
+#ifdef HEADLESS
+        cout << "Options: warmup=<count> frames=<count> output=<file.ppm|file.pfm> (optional %d for frame number)" << endl;
+        cout << "    report=<file.csv> (measured frames) min_rate=<MR/s> (fail if slower)" << endl;
+        cout << "    devices=<all|[platform:]index,...> (image rows split between devices)." << endl;
+#endif
+        cout << "Scene: models=<file.ply,...> instances=<count> seed=<value> device=<index in platform>" << endl;
+        cout << "    scene_cache=<file> (built scene, rebuilt if models or settings change)." << endl;
+        cout << "Builder: builder=<median|sah> bins=<count> leaf_cost=<cost> traversal_cost=<cost>" << endl;
+        cout << "    tri_threshold=<count> tri_format=<packed|wide|record|record_norm> aabb_format=<float|quant8>" << endl;
+        cout << "    aabb_threshold=<count> (smaller groups merge into parent) fanout=<count> (2-" << MAX_HITS << ", default " << MAX_HITS << ")." << endl;
+        cout << "Tracer: backend=<opencl|native|check> traversal=<wavefront|stack> ray_layout=<aos|soa> sort=<radix|bin>" << endl;
+        cout << "    radix=<auto|1-8> (sort digit bits) persistent=<units per compute unit> (0 -- off)" << endl;
+        cout << "    profile=<print|file.csv> (per-kernel timing, else host sync after process) program_cache=<directory> (compiled programs)." << endl;
+        cout << "Native: threads=<count> (0 -- all hardware threads) pin=<0|1> (worker threads on separate cores)." << endl;
+        return 0;
     }
 
     cl_uint index = atoi(arg[1]);
@@ -580,7 +1639,11 @@ int main(int n, const char **arg)
         cout << "Invalid platform index!" << endl;  return -1;
     }
 
+#ifdef HEADLESS
+    return ray_tracer(platform, platform_count, index, n, arg) ? 0 : -1;
+#else
     if(SDL_Init(SDL_INIT_VIDEO))return sdl_error("SDL_Init failed: ");
-    int res = ray_tracer(platform[index]) ? 0 : -1;
+    int res = ray_tracer(platform[index], n, arg) ? 0 : -1;
     SDL_Quit();  return res;
+#endif
 }
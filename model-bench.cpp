@@ -0,0 +1,109 @@
+// model-bench.cpp -- model loading benchmark
+//
+
+#include "model.h"
+#include "timer.h"
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <cstdlib>
+
+using namespace std;
+
+
+
+const char *get_option(int n, const char **arg, const char *name, const char *def)
+{
+    size_t len = strlen(name);
+    for(int i = 1; i < n; i++)
+        if(!strncmp(arg[i], name, len) && arg[i][len] == '=')return arg[i] + len + 1;
+    return def;
+}
+
+bool bench_load(const char *file, int repeat_count, const char *save, ThreadPool *pool)
+{
+    nsec_type best = 0, total = 0;  size_t tri_count = 0;
+    for(int i = 0; i < repeat_count; i++)
+    {
+        Model model;  nsec_type start = get_time();
+        if(!model.load(file, pool))
+        {
+            cout << "Failed to load model \"" << file << "\"!" << endl;  return false;
+        }
+        nsec_type delta = get_time() - start;  total += delta;
+        if(!i || delta < best)best = delta;  tri_count = model.triangle_count();
+
+        if(!save || i != repeat_count - 1)continue;
+        if(!model.save(save))
+        {
+            cout << "Failed to save model \"" << save << "\"!" << endl;  return false;
+        }
+        cout << "Saved binary model \"" << save << "\"." << endl;
+    }
+    cout << file << ": " << tri_count << " triangles, load " << 1e-6 * best << " ms best, " <<
+        1e-6 * total / repeat_count << " ms mean, " << 1e3 * tri_count / best << " Mtri/s." << endl;
+    return true;
+}
+
+bool bench_build(const char *file, int repeat_count, ThreadPool *pool, const BuildSettings &build)
+{
+    nsec_type best_split = 0, best_total = 0;  size_t tri_count = 0, group_count = 0, aabb_count = 0, mem_size = 0;  cl_float cost = 0;
+    for(int i = 0; i < repeat_count; i++)
+    {
+        Model model;
+        if(!model.load(file, pool))
+        {
+            cout << "Failed to load model \"" << file << "\"!" << endl;  return false;
+        }
+        nsec_type start = get_time();  model.subdivide(build, pool);  nsec_type split = get_time() - start;
+        ResourceManager mngr;  model.reserve(mngr, pool);  mngr.alloc();
+        model.fill(mngr, make_group_id(0, tr_none, sh_material), pool);  assert(mngr.full());
+        nsec_type total = get_time() - start;
+
+        if(!i || split < best_split)best_split = split;  if(!i || total < best_total)best_total = total;
+        tri_count = model.triangle_count();  group_count = mngr.group_count();  aabb_count = mngr.aabb_count();
+        mem_size = mngr.memory_size();
+        cost = model.sah_cost();
+    }
+    cout << file << ": " << (build.sah ? "binned SAH" : "median") << " subdivide " << 1e-6 * best_split << " ms (" <<
+        1e3 * tri_count / best_split << " Mtri/s), build " << 1e-6 * best_total << " ms, " <<
+        group_count << " groups, " << aabb_count << " AABBs, " << mem_size / 1024 << " KB, SAH cost " << cost << "." << endl;
+    return true;
+}
+
+int main(int n, const char **arg)
+{
+    int repeat_count = atoi(get_option(n, arg, "repeat", "5"));
+    const char *save = get_option(n, arg, "save", 0);
+    if(repeat_count < 1 || n < 2 || atoi(get_option(n, arg, "tri_threshold", "128")) < 2 ||
+        atoi(get_option(n, arg, "fanout", "0")) == 1)
+    {
+        cout << "Usage: model-bench <file.ply>... [repeat=<count>] [threads=<count>] [save=<binary.ply>]" << endl;
+        cout << "    [bins=<count>] [leaf_cost=<cost>] [traversal_cost=<cost>]" << endl;
+        cout << "    [tri_threshold=<count>] [tri_format=<packed|wide|record|record_norm>] [aabb_format=<float|quant8>]" << endl;
+        cout << "    [fanout=<count>] (0 -- unlimited, default " << MAX_HITS << ")" << endl;
+        return 0;
+    }
+    BuildSettings build;
+    build.bin_count = atoi(get_option(n, arg, "bins", "16"));
+    build.leaf_cost = atof(get_option(n, arg, "leaf_cost", "1"));
+    build.traversal_cost = atof(get_option(n, arg, "traversal_cost", "64"));
+    build.tri_threshold = atoi(get_option(n, arg, "tri_threshold", "128"));
+    const char *fanout = get_option(n, arg, "fanout", 0);  if(fanout)build.max_fanout = atoi(fanout);
+    build.quantize = !strcmp(get_option(n, arg, "aabb_format", "float"), "quant8");
+    const char *format = get_option(n, arg, "tri_format", "packed");
+    if(!strcmp(format, "wide"))build.tri_format = tf_wide;
+    else if(!strcmp(format, "record"))build.tri_format = tf_record;
+    else if(!strcmp(format, "record_norm"))build.tri_format = tf_record_norm;
+    ThreadPool pool(atoi(get_option(n, arg, "threads", "0")));
+    cout << "Using " << pool.thread_count() << " threads." << endl;
+
+    cout << setprecision(3) << fixed;
+    for(int i = 1; i < n; i++)if(!strchr(arg[i], '='))
+    {
+        if(!bench_load(arg[i], repeat_count, save, &pool))return -1;
+        build.sah = false;  if(!bench_build(arg[i], repeat_count, &pool, build))return -1;
+        build.sah = true;  if(!bench_build(arg[i], repeat_count, &pool, build))return -1;
+    }
+    return 0;
+}
@@ -3,6 +3,11 @@
 
 #include "model.h"
 #include <cstdio>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 using namespace std;
 
@@ -22,195 +27,829 @@ void set_camera(Camera &cam, size_t width, size_t height, cl_float tan_fov,
 
 
 
-size_t TriangleBlock::subdivide(size_t tri_threshold, size_t aabb_threshold, bool root)
+inline cl_float4 to_float4(const Vector &vec, cl_uint w)  // w is stored bitwise
 {
-    assert(!child[0] && !child[1]);
-    if(tri_count < tri_threshold)return 1;
-
-    Vector delta = max - min;  cl_float Vector::*axis;
-    if(delta.x > delta.y && delta.x > delta.z)axis = &Vector::x;
-    else if(delta.y > delta.z)axis = &Vector::y;
-    else axis = &Vector::z;
+    cl_float4 res;  res.s[0] = vec.x;  res.s[1] = vec.y;  res.s[2] = vec.z;
+    memcpy(&res.s[3], &w, sizeof(w));  return res;
+}
 
-    size_t center = tri_count / 2;
-    sort(tri, tri + tri_count, TriangleCompare(axis));
-    child[0] = new TriangleBlock(min, max, tri, center);
-    child[1] = new TriangleBlock(min, max, tri + center, tri_count - center);
-    child[0]->max.*axis = tri[center - 1]->center.*axis;
-    child[1]->min.*axis = tri[center]->center.*axis;
+inline cl_float half_area(const Vector &min, const Vector &max)
+{
+    Vector delta = max - min;  return delta.x * delta.y + delta.y * delta.z + delta.z * delta.x;
+}
 
-    size_t block_count =
-        child[0]->subdivide(tri_threshold, aabb_threshold, false) +
-        child[1]->subdivide(tri_threshold, aabb_threshold, false);
-    if(!root && block_count < aabb_threshold)return block_count;
-    aabb_count = block_count;  return 1;
+void BuildData::alloc(const Triangle *tri_, size_t count)
+{
+    assert(!index);  tri = tri_;  index = new cl_uint[count];
+    for(int k = 0; k < 3; k++)center[k] = new cl_float[count];
 }
 
-void TriangleBlock::reserve(ResourceManager &mngr)
+void BuildData::select(size_t begin, size_t end, size_t nth, int axis)
 {
-    if(child[0])
+    const cl_float *key = center[axis];
+    while(end - begin > 2)
     {
-        child[0]->reserve(mngr);  child[1]->reserve(mngr);  if(!aabb_count)return;
-        mngr.reserve_groups(1);  mngr.reserve_aabbs(aabb_count);  return;
+        size_t mid = begin + (end - begin) / 2, last = end - 1;  // median of three to begin
+        if(key[mid] < key[begin])swap(mid, begin);
+        if(key[last] < key[begin])swap(last, begin);
+        if(key[last] < key[mid])swap(last, mid);
+        swap(begin, mid);  cl_float pivot = key[begin];
+
+        size_t i = begin, j = end;
+        for(;;)
+        {
+            while(key[++i] < pivot);  while(pivot < key[--j]);
+            if(i >= j)break;  swap(i, j);
+        }
+        swap(begin, j);  if(nth == j)return;
+        if(nth < j)end = j;  else begin = j + 1;
     }
+    if(end - begin == 2 && key[begin + 1] < key[begin])swap(begin, begin + 1);
+}
 
-    mngr.reserve_groups(1);  mngr.reserve_triangles(tri_count);  int pos = 0;
-    for(size_t i = 0; i < tri_count; i++)
+template<typename P> size_t BuildData::partition(size_t begin, size_t end, const P &pred)
+{
+    for(;;)
     {
-        if(tri[i]->pt[0]->index < 0)tri[i]->pt[0]->index = pos++;
-        if(tri[i]->pt[1]->index < 0)tri[i]->pt[1]->index = pos++;
-        if(tri[i]->pt[2]->index < 0)tri[i]->pt[2]->index = pos++;
+        while(begin < end && pred(begin))begin++;
+        while(begin < end && !pred(end - 1))end--;
+        if(begin >= end)return begin;  swap(begin++, --end);
     }
-    for(size_t i = 0; i < tri_count; i++)
-        tri[i]->pt[0]->index = tri[i]->pt[1]->index = tri[i]->pt[2]->index = -1;
-    assert(pos < (1 << 10));  mngr.reserve_vertices(vtx_count = pos);
 }
 
-inline cl_uint put_vertex(ModelVertex *vtx, Vector &min, Vector &max, Vertex *buf, int &pos)
+
+static cl_float Vector::*const axes[] = {&Vector::x, &Vector::y, &Vector::z};
+
+size_t TriangleBlock::split_median()
 {
-    int index = vtx->index;  if(index >= 0)return index;  index = vtx->index = pos++;
-    buf[index].pos = to_float3(vtx->pos);  buf[index].norm = to_float3(vtx->norm);
-    update_bounds(min, max, vtx->pos);  return index;
+    Vector delta = max - min;  int axis;
+    if(delta.x > delta.y && delta.x > delta.z)axis = 0;
+    else if(delta.y > delta.z)axis = 1;
+    else axis = 2;
+
+    size_t center = tri_count / 2;  data->select(offs, offs + tri_count, offs + center, axis);
+    cl_float left_max = data->centroid(offs, axis);
+    for(size_t i = 1; i < center; i++)left_max = std::max(left_max, data->centroid(offs + i, axis));
+    child[0] = new TriangleBlock(min, max, data, offs, center);
+    child[1] = new TriangleBlock(min, max, data, offs + center, tri_count - center);
+    child[0]->max.*axes[axis] = left_max;
+    child[1]->min.*axes[axis] = data->centroid(offs + center, axis);
+    return center;
 }
 
-cl_uint TriangleBlock::fill(ResourceManager &mngr, cl_uint material_id, cl_uint *aabb_index)
+struct SAHBin
 {
-    if(child[0])
+    Vector min, max, center_min, center_max;
+    size_t count;
+};
+
+size_t TriangleBlock::split_sah(const BuildSettings &settings)
+{
+    const size_t n = settings.bin_count;  if(tri_count < 2 || n < 2)return 0;
+    SAHBin *bin = new SAHBin[3 * n];  cl_float *right_area = new cl_float[n];
+    for(size_t i = 0; i < 3 * n; i++)
     {
-        if(aabb_count)
-        {
-            size_t grp_pos = mngr.get_groups(1);  Group *grp = mngr.group(grp_pos);
-            cl_uint aabb_sub = grp->aabb.aabb_offs = mngr.get_aabbs(aabb_count);
-            grp->aabb.aabb_count = aabb_count;  grp->aabb.flags = 0;
+        init_bounds(bin[i].min, bin[i].max);
+        init_bounds(bin[i].center_min, bin[i].center_max);  bin[i].count = 0;
+    }
 
-            child[0]->fill(mngr, material_id, &aabb_sub);
-            child[1]->fill(mngr, material_id, &aabb_sub);
-            assert(aabb_sub == grp->aabb.aabb_offs + aabb_count);
-            min = vec_min(child[0]->min, child[1]->min);
-            max = vec_max(child[0]->max, child[1]->max);
+    Vector scale = max - min;
+    scale.x = scale.x > 0 ? n / scale.x : 0;
+    scale.y = scale.y > 0 ? n / scale.y : 0;
+    scale.z = scale.z > 0 ? n / scale.z : 0;
+    for(size_t i = offs; i < offs + tri_count; i++)
+    {
+        const Triangle &tri = data->triangle(i);  Vector center = data->centroid(i);
+        for(int k = 0; k < 3; k++)
+        {
+            size_t index = size_t((center.*axes[k] - min.*axes[k]) * scale.*axes[k]);
+            SAHBin &cur = bin[k * n + std::min(index, n - 1)];
+            cur.min = vec_min(cur.min, tri.min);  cur.max = vec_max(cur.max, tri.max);
+            update_bounds(cur.center_min, cur.center_max, center);  cur.count++;
+        }
+    }
 
-            cl_uint group_id = make_group_id(grp_pos, tr_ortho, sh_aabb);
-            if(aabb_index)
+    int best_axis = -1;  size_t best_bin = 0;
+    cl_float best_cost = std::numeric_limits<cl_float>::infinity();
+    for(int k = 0; k < 3; k++)if(scale.*axes[k] > 0)
+    {
+        SAHBin *cur = bin + k * n;  Vector acc_min, acc_max;  init_bounds(acc_min, acc_max);
+        for(size_t i = n - 1; i > 0; i--)
+        {
+            acc_min = vec_min(acc_min, cur[i].min);  acc_max = vec_max(acc_max, cur[i].max);
+            right_area[i] = half_area(acc_min, acc_max);
+        }
+        size_t left = 0;  init_bounds(acc_min, acc_max);
+        for(size_t i = 1; i < n; i++)
+        {
+            acc_min = vec_min(acc_min, cur[i - 1].min);  acc_max = vec_max(acc_max, cur[i - 1].max);
+            left += cur[i - 1].count;  if(!left || left == tri_count)continue;
+            cl_float cost = half_area(acc_min, acc_max) * left + right_area[i] * (tri_count - left);
+            if(cost < best_cost)
             {
-                AABB *aabb = mngr.aabb((*aabb_index)++);
-                aabb->min = to_float3(min);  aabb->max = to_float3(max);
-                aabb->group_id = group_id;  aabb->local_id = 0;
+                best_cost = cost;  best_axis = k;  best_bin = i;
             }
-            return group_id;
         }
-        else
+    }
+
+    Vector tri_min, tri_max;  init_bounds(tri_min, tri_max);
+    for(size_t i = 0; i < n; i++)
+    {
+        tri_min = vec_min(tri_min, bin[i].min);  tri_max = vec_max(tri_max, bin[i].max);
+    }
+    cl_float area = half_area(tri_min, tri_max);
+    best_cost = settings.traversal_cost + settings.leaf_cost * best_cost / area;
+    if(best_axis < 0 || tri_count < settings.tri_threshold && !(best_cost < settings.leaf_cost * tri_count))
+    {
+        delete [] bin;  delete [] right_area;  return 0;
+    }
+
+    const BuildData &build = *data;  int axis = best_axis;
+    cl_float base = min.*axes[axis], mul = scale.*axes[axis];
+    size_t count = data->partition(offs, offs + tri_count, [&](size_t i)
+        {
+            return std::min(size_t((build.centroid(i, axis) - base) * mul), n - 1) < best_bin;
+        }) - offs;
+
+    Vector bound_min[2], bound_max[2];
+    for(int side = 0; side < 2; side++)init_bounds(bound_min[side], bound_max[side]);
+    for(size_t i = 0; i < n; i++)
+    {
+        const SAHBin &cur = bin[best_axis * n + i];  int side = i >= best_bin;
+        bound_min[side] = vec_min(bound_min[side], cur.center_min);
+        bound_max[side] = vec_max(bound_max[side], cur.center_max);
+    }
+    delete [] bin;  delete [] right_area;
+
+    assert(count && count < tri_count);
+    child[0] = new TriangleBlock(bound_min[0], bound_max[0], data, offs, count);
+    child[1] = new TriangleBlock(bound_min[1], bound_max[1], data, offs + count, tri_count - count);
+    return count;
+}
+
+inline size_t aabb_slots(size_t count, const BuildSettings &settings)
+{
+    return settings.quantize ? 1 + (count + 1) / 2 : count;
+}
+
+inline cl_uint quantize(const cl_float3 &val, const Vector &base, const Vector &scale, bool up)
+{
+    cl_uint res = 0;
+    for(int k = 0; k < 3; k++)
+    {
+        cl_float org = base.*axes[k], mul = scale.*axes[k];  if(!(mul > 0))continue;
+        cl_float pos = (val.s[k] - org) / mul;  int q = int(up ? ceil(pos) : floor(pos));
+        if(up ? org + q * mul < val.s[k] : org + q * mul > val.s[k])q += up ? 1 : -1;  // stay conservative
+        res |= cl_uint(std::min(std::max(q, 0), 255)) << 8 * k;
+    }
+    return res;
+}
+
+void quantize_aabbs(AABB *res, const AABB *aabb, size_t count, const Vector &min, const Vector &max)
+{
+    Vector scale = (max - min) * (1 + 1e-5f) / 255;  // margin for rounding at the upper end
+    res[0].min = to_float3(min);  res[0].max = to_float3(scale);  res[0].group_id = res[0].local_id = 0;
+
+    QuantizedAABB *quant = reinterpret_cast<QuantizedAABB *>(res + 1);
+    for(size_t i = 0; i < count; i++)
+    {
+        quant[i].min = quantize(aabb[i].min, min, scale, false);
+        quant[i].max = quantize(aabb[i].max, min, scale, true);
+        quant[i].group_id = aabb[i].group_id;  quant[i].local_id = aabb[i].local_id;
+    }
+    if(count & 1)memset(&quant[count], 0, sizeof(QuantizedAABB));
+}
+
+template<typename F0, typename F1> inline void fork_join(ThreadPool *pool, bool parallel, const F0 &func0, const F1 &func1)
+{
+    if(pool && parallel)pool->fork_join(func0, func1);
+    else
+    {
+        func0();  func1();
+    }
+}
+
+size_t TriangleBlock::subdivide(const BuildSettings &settings, ThreadPool *pool, bool root)
+{
+    assert(!child[0] && !child[1]);
+    if(!(settings.sah && split_sah(settings)))
+    {
+        if(tri_count < settings.tri_threshold && mesh_indices_fit(tri_count, settings.tri_format))return entry_count = 1;
+        split_median();  // also any oversized leaf of SAH
+    }
+
+    size_t count[2];
+    fork_join(pool, tri_count >= settings.task_threshold,
+        [&]{ count[0] = child[0]->subdivide(settings, pool, false); },
+        [&]{ count[1] = child[1]->subdivide(settings, pool, false); });
+    if(settings.max_fanout)while(count[0] + count[1] > settings.max_fanout)
+    {
+        int k = count[1] > count[0];  count[k] = child[k]->seal();
+    }
+    size_t block_count = count[0] + count[1];
+    if(!root && block_count < settings.aabb_threshold)return entry_count = block_count;
+    aabb_count = block_count;  return entry_count = 1;
+}
+
+void TriangleBlock::reserve(const BuildSettings &settings, ThreadPool *pool)
+{
+    if(child[0])
+    {
+        fork_join(pool, tri_count >= settings.task_threshold,
+            [&]{ child[0]->reserve(settings, pool); },
+            [&]{ child[1]->reserve(settings, pool); });
+        total = child[0]->total + child[1]->total;
+        if(aabb_count)total = total + ResourceCount(1, aabb_slots(aabb_count, settings), 0, 0);  return;
+    }
+
+    assert(!vtx);  vtx = new ModelVertex *[3 * tri_count];
+    for(size_t i = 0; i < tri_count; i++)for(int k = 0; k < 3; k++)vtx[3 * i + k] = data->triangle(offs + i).pt[k];
+    sort(vtx, vtx + 3 * tri_count);  vtx_count = unique(vtx, vtx + 3 * tri_count) - vtx;
+    total = ResourceCount(1, 0, vtx_count, 0);
+    switch(settings.tri_format)
+    {
+    case tf_record:  shader = sh_mesh_record;  total.rec = 3 * tri_count;  return;
+    case tf_record_norm:  shader = sh_mesh_record_norm;  total.rec = 4 * tri_count;  return;
+    default:  break;
+    }
+    assert(vtx_count <= (1 << MESH_WIDE_INDEX_BITS));
+    if(settings.tri_format == tf_wide || vtx_count > (1 << MESH_INDEX_BITS))
+    {
+        shader = sh_mesh_wide;  total.tri = 2 * tri_count;
+    }
+    else
+    {
+        shader = sh_mesh;  total.tri = tri_count;
+    }
+}
+
+cl_uint TriangleBlock::fill(ResourceManager &mngr, const ResourceCount &pos, cl_uint material_id,
+    const BuildSettings &settings, ThreadPool *pool, AABB *aabb)
+{
+    if(child[0])
+    {
+        ResourceCount sub = pos;  AABB *sub_aabb = aabb, *tmp = 0;  cl_uint group_id = 0;
+        if(aabb_count)
+        {
+            Group *grp = mngr.group(pos.grp);  grp->aabb.aabb_offs = pos.aabb;
+            grp->aabb.aabb_count = aabb_count;  grp->aabb.flags = settings.quantize ? f_quantized : 0;
+            sub_aabb = settings.quantize ? tmp = new AABB[aabb_count] : mngr.aabb(pos.aabb);
+            group_id = make_group_id(pos.grp, tr_ortho, sh_aabb);
+            sub.grp++;  sub.aabb += aabb_slots(aabb_count, settings);
+        }
+        assert(sub_aabb);
+        fork_join(pool, tri_count >= settings.task_threshold,
+            [&]{ child[0]->fill(mngr, sub, material_id, settings, pool, sub_aabb); },
+            [&]{ child[1]->fill(mngr, sub + child[0]->total, material_id, settings, pool, sub_aabb + child[0]->entry_count); });
+        min = vec_min(child[0]->min, child[1]->min);
+        max = vec_max(child[0]->max, child[1]->max);
+        if(!aabb_count)return 0;
+        if(tmp)
         {
-            child[0]->fill(mngr, material_id, aabb_index);
-            child[1]->fill(mngr, material_id, aabb_index);
-            min = vec_min(child[0]->min, child[1]->min);
-            max = vec_max(child[0]->max, child[1]->max);
+            quantize_aabbs(mngr.aabb(pos.aabb), tmp, aabb_count, min, max);  delete [] tmp;
         }
-        return 0;
+        if(aabb)
+        {
+            aabb->min = to_float3(min);  aabb->max = to_float3(max);
+            aabb->group_id = group_id;  aabb->local_id = 0;
+        }
+        return group_id;
     }
 
-    size_t grp_pos = mngr.get_groups(1);  Group *grp = mngr.group(grp_pos);
-    Vertex *vtx_buf = mngr.vertex(grp->mesh.vtx_offs = mngr.get_vertices(vtx_count));
-    cl_uint *tri_buf = mngr.triangle(grp->mesh.tri_offs = mngr.get_triangles(tri_count));
+    Group *grp = mngr.group(pos.grp);
+    Vertex *vtx_buf = mngr.vertex(grp->mesh.vtx_offs = pos.vtx);
+    cl_uint *tri_buf = 0;  cl_float4 *rec_buf = 0;
+    if(shader == sh_mesh || shader == sh_mesh_wide)tri_buf = mngr.triangle(grp->mesh.tri_offs = pos.tri);
+    else rec_buf = mngr.record(grp->mesh.tri_offs = pos.rec);
     grp->mesh.tri_count = tri_count;  grp->mesh.material_id = material_id;
 
-    int pos = 0;  init_bounds(min, max);
-    for(size_t i = 0; i < tri_count; i++)
+    init_bounds(min, max);
+    for(size_t i = 0; i < vtx_count; i++)
     {
-        cl_uint index0 = put_vertex(tri[i]->pt[0], min, max, vtx_buf, pos);
-        cl_uint index1 = put_vertex(tri[i]->pt[1], min, max, vtx_buf, pos);
-        cl_uint index2 = put_vertex(tri[i]->pt[2], min, max, vtx_buf, pos);
-        tri_buf[i] = index0 | index1 << 10 | index2 << 20;
+        vtx_buf[i].pos = to_float3(vtx[i]->pos);  vtx_buf[i].norm = to_float3(vtx[i]->norm);
+        update_bounds(min, max, vtx[i]->pos);
     }
     for(size_t i = 0; i < tri_count; i++)
-        tri[i]->pt[0]->index = tri[i]->pt[1]->index = tri[i]->pt[2]->index = -1;
-    assert(size_t(pos) == vtx_count);
+    {
+        const Triangle &tri = data->triangle(offs + i);  cl_uint index[3];
+        for(int k = 0; k < 3; k++)index[k] = lower_bound(vtx, vtx + vtx_count, tri.pt[k]) - vtx;
+        switch(shader)
+        {
+        case sh_mesh:
+            tri_buf[i] = index[0] | index[1] << 10 | index[2] << 20;  break;
+
+        case sh_mesh_wide:
+            tri_buf[2 * i] = index[0] | index[1] << 16;  tri_buf[2 * i + 1] = index[2];  break;
 
-    cl_uint group_id = make_group_id(grp_pos, tr_ortho, sh_mesh);
-    if(aabb_index)
+        default:
+            {
+                Vector r = tri.pt[0]->pos, p = tri.pt[1]->pos - r, q = tri.pt[2]->pos - r;
+                cl_float4 *rec = rec_buf;
+                if(shader == sh_mesh_record)rec += 3 * i;
+                else
+                {
+                    rec += 4 * i;  rec[3] = to_float4(p % q, 0);
+                }
+                rec[0] = to_float4(r, index[0]);  rec[1] = to_float4(p, index[1]);  rec[2] = to_float4(q, index[2]);
+            }
+        }
+    }
+
+    cl_uint group_id = make_group_id(pos.grp, tr_ortho, shader);
+    if(aabb)
     {
-        AABB *aabb = mngr.aabb((*aabb_index)++);
         aabb->min = to_float3(min);  aabb->max = to_float3(max);
         aabb->group_id = group_id;  aabb->local_id = 0;
     }
     return group_id;
 }
 
+cl_float TriangleBlock::sah_cost(const BuildSettings &settings) const
+{
+    if(!child[0])return settings.leaf_cost * tri_count;
+    cl_float area = half_area(min, max);  if(!(area > 0))return settings.traversal_cost;
+    return settings.traversal_cost +
+        (half_area(child[0]->min, child[0]->max) * child[0]->sah_cost(settings) +
+        half_area(child[1]->min, child[1]->max) * child[1]->sah_cost(settings)) / area;
+}
 
-bool Model::load(const char *file)
+
+
+class MappedFile
 {
-    assert(!vtx && !tri);  FILE *input = fopen(file, "r");  if(!input)return false;
+    int fd;  const char *data;  size_t size;
 
-    char buf[256], fmt[] = "%f %f %f %*f %*f %*f %*f ";
+public:
+    MappedFile() : fd(-1), data(0), size(0)
+    {
+    }
 
-    static const char *header1 =
-        "ply "
-        "format ascii 1.0 "
-        "comment %*[^\n] "
-        "element vertex %zu "
-        "property float x "
-        "property float y "
-        "property float z ";
+    ~MappedFile()
+    {
+        if(data)munmap(const_cast<char *>(data), size);  if(fd >= 0)close(fd);
+    }
 
-    static const char *header2 =
-        "property float %255s ";
+    bool open(const char *file)
+    {
+        assert(fd < 0);  fd = ::open(file, O_RDONLY);  if(fd < 0)return false;
+        struct stat info;  if(fstat(fd, &info) || !info.st_size)return false;
+        void *ptr = mmap(0, size = info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(ptr == MAP_FAILED)return false;  data = static_cast<const char *>(ptr);
+        madvise(ptr, size, MADV_SEQUENTIAL);  return true;
+    }
 
-    static const char *header3 =
-        "element face %zu "
-        "property list uchar %*[ui]nt vertex_indices "
-        "end_header ";
+    const char *begin() const
+    {
+        return data;
+    }
 
-    if(fscanf(input, header1, &vtx_count) != 1 || !vtx_count)
+    const char *end() const
     {
-        fclose(input);  return false;
+        return data + size;
     }
-    size_t len = 9;
-    while(fscanf(input, header2, buf) == 1)len += 4;
-    if(len >= sizeof(fmt))
+};
+
+
+enum PlyFormat
+{
+    ply_ascii, ply_binary_le, ply_binary_be
+};
+
+enum PlyType
+{
+    ply_none, ply_int8, ply_uint8, ply_int16, ply_uint16, ply_int32, ply_uint32, ply_float32, ply_float64
+};
+
+enum PlyTarget
+{
+    tg_skip, tg_x, tg_y, tg_z, tg_index
+};
+
+struct PlyProperty
+{
+    PlyType type, count_type;  // count_type != ply_none for lists
+    PlyTarget target;
+};
+
+struct PlyElement
+{
+    static const size_t max_props = 32;
+
+    size_t count, prop_count;
+    PlyProperty prop[max_props];
+    bool vertex, face;
+};
+
+PlyType ply_type(const char *name)
+{
+    static const char *names[][2] =
     {
-        fclose(input);  return false;
+        {"char", "int8"}, {"uchar", "uint8"}, {"short", "int16"}, {"ushort", "uint16"},
+        {"int", "int32"}, {"uint", "uint32"}, {"float", "float32"}, {"double", "float64"}
+    };
+    for(int i = 0; i < 8; i++)
+        if(!strcmp(name, names[i][0]) || !strcmp(name, names[i][1]))return PlyType(ply_int8 + i);
+    return ply_none;
+}
+
+inline size_t ply_size(PlyType type)
+{
+    static const size_t size[] = {0, 1, 1, 2, 2, 4, 4, 4, 8};  return size[type];
+}
+
+
+struct PlyHeader
+{
+    static const size_t max_elements = 16;
+
+    PlyFormat format;  size_t elem_count;
+    PlyElement elem[max_elements];
+    PlyElement *vertex, *face;
+
+
+    const char *parse(const char *ptr, const char *end);  // returns start of data
+};
+
+const char *PlyHeader::parse(const char *ptr, const char *end)
+{
+    elem_count = 0;  vertex = face = 0;  bool has_format = false;
+    for(size_t line_index = 0;; line_index++)
+    {
+        const char *next = static_cast<const char *>(memchr(ptr, '\n', end - ptr));
+        if(!next)return 0;  size_t len = next - ptr;  if(len && next[-1] == '\r')len--;
+        char line[256];  if(len >= sizeof(line))return 0;
+        memcpy(line, ptr, len);  line[len] = '\0';  ptr = next + 1;
+
+        char word[3][64];  size_t count;
+        if(!line_index)
+        {
+            if(strcmp(line, "ply"))return 0;
+        }
+        else if(sscanf(line, "format %63s %63s", word[0], word[1]) == 2)
+        {
+            if(has_format || strcmp(word[1], "1.0"))return 0;
+            if(!strcmp(word[0], "ascii"))format = ply_ascii;
+            else if(!strcmp(word[0], "binary_little_endian"))format = ply_binary_le;
+            else if(!strcmp(word[0], "binary_big_endian"))format = ply_binary_be;
+            else return 0;  has_format = true;
+        }
+        else if(sscanf(line, "element %63s %zu", word[0], &count) == 2)
+        {
+            if(elem_count == max_elements)return 0;
+            PlyElement &cur = elem[elem_count++];  cur.count = count;  cur.prop_count = 0;
+            cur.vertex = !strcmp(word[0], "vertex");  cur.face = !strcmp(word[0], "face");
+            if(cur.vertex)
+            {
+                if(vertex)return 0;  vertex = &cur;
+            }
+            if(cur.face)
+            {
+                if(face)return 0;  face = &cur;
+            }
+        }
+        else if(sscanf(line, "property list %63s %63s %63s", word[0], word[1], word[2]) == 3)
+        {
+            if(!elem_count)return 0;  PlyElement &cur = elem[elem_count - 1];
+            if(cur.prop_count == PlyElement::max_props)return 0;
+            PlyProperty &prop = cur.prop[cur.prop_count++];
+            prop.count_type = ply_type(word[0]);  prop.type = ply_type(word[1]);  prop.target = tg_skip;
+            if(!prop.count_type || prop.count_type >= ply_float32 || !prop.type)return 0;
+            if(cur.face && (!strcmp(word[2], "vertex_indices") || !strcmp(word[2], "vertex_index")))
+            {
+                if(prop.type >= ply_float32)return 0;  prop.target = tg_index;
+            }
+        }
+        else if(sscanf(line, "property %63s %63s", word[0], word[1]) == 2)
+        {
+            if(!elem_count)return 0;  PlyElement &cur = elem[elem_count - 1];
+            if(cur.prop_count == PlyElement::max_props)return 0;
+            PlyProperty &prop = cur.prop[cur.prop_count++];
+            prop.count_type = ply_none;  prop.type = ply_type(word[0]);  prop.target = tg_skip;
+            if(!prop.type)return 0;  if(!cur.vertex || word[1][1])continue;
+            if(word[1][0] == 'x')prop.target = tg_x;
+            else if(word[1][0] == 'y')prop.target = tg_y;
+            else if(word[1][0] == 'z')prop.target = tg_z;
+        }
+        else if(!strcmp(line, "end_header"))break;
+        else if(strncmp(line, "comment", 7) && strncmp(line, "obj_info", 8))return 0;
     }
-    fmt[len] = '\0';
-    if(fscanf(input, header3, &tri_count) != 1 || !tri_count)
+    if(!has_format || !vertex || !face)return 0;
+
+    int found = 0;
+    for(size_t i = 0; i < vertex->prop_count; i++)
+        if(vertex->prop[i].target)found |= 1 << vertex->prop[i].target;
+    if(found != (1 << tg_x | 1 << tg_y | 1 << tg_z))return 0;
+    for(size_t i = 0; i < face->prop_count; i++)if(face->prop[i].target == tg_index)return ptr;
+    return 0;
+}
+
+
+inline bool is_space(char ch)
+{
+    return ch == ' ' || ch == '\n' || ch == '\r' || ch == '\t';
+}
+
+inline const char *skip_space(const char *ptr, const char *end)
+{
+    while(ptr < end && is_space(*ptr))ptr++;  return ptr;
+}
+
+inline bool skip_token(const char *&ptr, const char *end)
+{
+    ptr = skip_space(ptr, end);  const char *start = ptr;
+    while(ptr < end && !is_space(*ptr))ptr++;  return ptr != start;
+}
+
+inline bool scan_uint(const char *&ptr, const char *end, size_t &res)
+{
+    ptr = skip_space(ptr, end);  const char *start = ptr;  res = 0;
+    for(unsigned digit; ptr < end && (digit = *ptr - '0') < 10; ptr++)res = 10 * res + digit;
+    return ptr != start && (ptr == end || is_space(*ptr));
+}
+
+bool scan_float(const char *&ptr, const char *end, cl_float &res)
+{
+    static const double pow10[] =
     {
-        fclose(input);  return false;
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const unsigned long long limit = 100000000000000000ull;
+
+    ptr = skip_space(ptr, end);
+    bool neg = false;  if(ptr < end && (*ptr == '-' || *ptr == '+'))neg = *ptr++ == '-';
+
+    unsigned long long mant = 0;  int exp = 0, digits = 0;  unsigned digit;
+    for(; ptr < end && (digit = *ptr - '0') < 10; ptr++, digits++)
+        if(mant < limit)mant = 10 * mant + digit;  else exp++;
+    if(ptr < end && *ptr == '.')
+        for(ptr++; ptr < end && (digit = *ptr - '0') < 10; ptr++, digits++)
+            if(mant < limit)
+            {
+                mant = 10 * mant + digit;  exp--;
+            }
+    if(!digits)return false;
+
+    if(ptr < end && (*ptr == 'e' || *ptr == 'E'))
+    {
+        bool exp_neg = false;  ptr++;
+        if(ptr < end && (*ptr == '-' || *ptr == '+'))exp_neg = *ptr++ == '-';
+        int val = 0;  const char *start = ptr;
+        for(; ptr < end && (digit = *ptr - '0') < 10; ptr++)if(val < 10000)val = 10 * val + digit;
+        if(ptr == start)return false;  exp += exp_neg ? -val : val;
     }
-    vtx = new ModelVertex[vtx_count];  tri = new Triangle[tri_count];  tri_ptr = new Triangle *[tri_count];
-    for(size_t i = 0; i < vtx_count; i++)
+    if(ptr < end && !is_space(*ptr))return false;
+
+    double val = mant;
+    if(exp < 0)val = exp >= -22 ? val / pow10[-exp] : val * pow(10.0, exp);
+    else if(exp)val = exp <= 22 ? val * pow10[exp] : val * pow(10.0, exp);
+    res = neg ? -val : val;  return true;
+}
+
+
+template<typename T, bool swap> inline T load_value(const char *ptr)
+{
+    char buf[sizeof(T)];
+    if(swap)for(size_t i = 0; i < sizeof(T); i++)buf[i] = ptr[sizeof(T) - 1 - i];
+    else memcpy(buf, ptr, sizeof(T));
+    T res;  memcpy(&res, buf, sizeof(T));  return res;
+}
+
+template<bool swap> inline double load_value(const char *ptr, PlyType type)
+{
+    switch(type)
+    {
+    case ply_int8:     return load_value<signed char, swap>(ptr);
+    case ply_uint8:    return load_value<unsigned char, swap>(ptr);
+    case ply_int16:    return load_value<short, swap>(ptr);
+    case ply_uint16:   return load_value<unsigned short, swap>(ptr);
+    case ply_int32:    return load_value<int, swap>(ptr);
+    case ply_uint32:   return load_value<unsigned, swap>(ptr);
+    case ply_float32:  return load_value<float, swap>(ptr);
+    case ply_float64:  return load_value<double, swap>(ptr);
+    default:  assert(false);  return 0;
+    }
+}
+
+
+class PlyReader
+{
+    ModelVertex *vtx;  Triangle *tri;
+    size_t vtx_count;
+
+
+    bool read_ascii(const PlyElement &elem, size_t i, const char *&ptr, const char *end);
+    bool read_lines(const PlyHeader &header, size_t line, const char *ptr, const char *end);
+    bool read_parallel(const PlyHeader &header, const char *ptr, const char *end, ThreadPool &pool);
+    template<bool swap> bool read_binary(const PlyElement &elem, const char *&ptr, const char *end);
+
+public:
+    PlyReader(ModelVertex *vtx_, size_t vtx_count_, Triangle *tri_) : vtx(vtx_), tri(tri_), vtx_count(vtx_count_)
     {
-        if(fscanf(input, fmt, &vtx[i].pos.x, &vtx[i].pos.y, &vtx[i].pos.z) != 3)
+    }
+
+    bool read(const PlyHeader &header, const char *ptr, const char *end, ThreadPool *pool);
+};
+
+bool PlyReader::read_ascii(const PlyElement &elem, size_t i, const char *&ptr, const char *end)
+{
+    for(size_t j = 0; j < elem.prop_count; j++)
+    {
+        const PlyProperty &prop = elem.prop[j];
+        if(prop.count_type)
         {
-            fclose(input);  return false;
+            size_t n, index[3];  if(!scan_uint(ptr, end, n))return false;
+            if(prop.target != tg_index)
+            {
+                for(size_t k = 0; k < n; k++)if(!skip_token(ptr, end))return false;
+                continue;
+            }
+            if(n != 3)return false;
+            for(int k = 0; k < 3; k++)
+            {
+                if(!scan_uint(ptr, end, index[k]) || index[k] >= vtx_count)return false;
+                tri[i].pt[k] = &vtx[index[k]];
+            }
+            continue;
+        }
+        switch(prop.target)
+        {
+        case tg_x:  if(!scan_float(ptr, end, vtx[i].pos.x))return false;  break;
+        case tg_y:  if(!scan_float(ptr, end, vtx[i].pos.y))return false;  break;
+        case tg_z:  if(!scan_float(ptr, end, vtx[i].pos.z))return false;  break;
+        default:  if(!skip_token(ptr, end))return false;
         }
     }
-    for(size_t i = 0, index[3]; i < tri_count; i++)
+    return true;
+}
+
+bool PlyReader::read_lines(const PlyHeader &header, size_t line, const char *ptr, const char *end)  // one record per line
+{
+    size_t k = 0;
+    while(k < header.elem_count && line >= header.elem[k].count)line -= header.elem[k++].count;
+    while(ptr < end)
     {
-        if(fscanf(input, "3 %zu %zu %zu ", &index[0], &index[1], &index[2]) != 3 ||
-            index[0] >= vtx_count || index[1] >= vtx_count || index[2] >= vtx_count)
+        const char *next = static_cast<const char *>(memchr(ptr, '\n', end - ptr));  if(!next)next = end;
+        if(k < header.elem_count)
         {
-            fclose(input);  return false;
+            if(!read_ascii(header.elem[k], line, ptr, next))return false;
+            if(++line == header.elem[k].count)
+            {
+                k++;  line = 0;
+            }
         }
-        tri[i].pt[0] = &vtx[index[0]];  tri[i].pt[1] = &vtx[index[1]];  tri[i].pt[2] = &vtx[index[2]];
+        if(skip_space(ptr, next) != next)return false;  ptr = next + 1;
     }
-    fclose(input);  prepare();  return true;
+    return true;
 }
 
-void Model::prepare()
+bool PlyReader::read_parallel(const PlyHeader &header, const char *ptr, const char *end, ThreadPool &pool)
 {
-    assert(!root);
-    for(size_t i = 0; i < vtx_count; i++)
+    const size_t min_chunk = 1 << 16;
+    size_t chunk_count = min(4 * pool.thread_count(), size_t(end - ptr) / min_chunk + 1);
+    const char **start = new const char *[chunk_count + 1];  size_t *line = new size_t[chunk_count + 1];
+    start[0] = ptr;  start[chunk_count] = end;
+    for(size_t i = 1; i < chunk_count; i++)
+    {
+        const char *pos = max(start[i - 1], ptr + (end - ptr) * i / chunk_count);
+        const char *next = static_cast<const char *>(memchr(pos, '\n', end - pos));
+        start[i] = next ? next + 1 : end;
+    }
+
+    pool.run(chunk_count, [&](size_t i)
+        {
+            size_t n = 0;
+            for(const char *pos = start[i]; pos < start[i + 1]; n++)
+            {
+                const char *next = static_cast<const char *>(memchr(pos, '\n', start[i + 1] - pos));
+                if(!next)break;  pos = next + 1;
+            }
+            line[i + 1] = n;
+        });
+
+    size_t total = 0;  line[0] = 0;
+    for(size_t i = 0; i < header.elem_count; i++)total += header.elem[i].count;
+    for(size_t i = 1; i <= chunk_count; i++)line[i] += line[i - 1];
+    bool res = line[chunk_count] + (ptr < end && end[-1] != '\n') >= total;
+
+    atomic<bool> fail(false);
+    if(res)pool.run(chunk_count, [&](size_t i)
+        {
+            if(!read_lines(header, line[i], start[i], start[i + 1]))fail = true;
+        });
+    delete [] start;  delete [] line;  return res && !fail;
+}
+template<bool swap> bool PlyReader::read_binary(const PlyElement &elem, const char *&ptr, const char *end)
+{
+    for(size_t i = 0; i < elem.count; i++)for(size_t j = 0; j < elem.prop_count; j++)
+    {
+        const PlyProperty &prop = elem.prop[j];  size_t size = ply_size(prop.type);
+        if(prop.count_type)
+        {
+            size_t count_size = ply_size(prop.count_type);
+            if(size_t(end - ptr) < count_size)return false;
+            double n = load_value<swap>(ptr, prop.count_type);  ptr += count_size;
+            if(size_t(end - ptr) < n * size)return false;
+            if(prop.target != tg_index)
+            {
+                ptr += size_t(n) * size;  continue;
+            }
+            if(n != 3)return false;
+            for(int k = 0; k < 3; k++, ptr += size)
+            {
+                double index = load_value<swap>(ptr, prop.type);
+                if(!(index >= 0 && index < vtx_count))return false;
+                tri[i].pt[k] = &vtx[size_t(index)];
+            }
+            continue;
+        }
+        if(size_t(end - ptr) < size)return false;
+        switch(prop.target)
+        {
+        case tg_x:  vtx[i].pos.x = load_value<swap>(ptr, prop.type);  break;
+        case tg_y:  vtx[i].pos.y = load_value<swap>(ptr, prop.type);  break;
+        case tg_z:  vtx[i].pos.z = load_value<swap>(ptr, prop.type);  break;
+        default:  break;
+        }
+        ptr += size;
+    }
+    return true;
+}
+
+bool PlyReader::read(const PlyHeader &header, const char *ptr, const char *end, ThreadPool *pool)
+{
+    if(header.format == ply_ascii)
+    {
+        if(pool && pool->thread_count() > 1 && read_parallel(header, ptr, end, *pool))return true;
+        for(size_t i = 0; i < header.elem_count; i++)for(size_t j = 0; j < header.elem[i].count; j++)
+            if(!read_ascii(header.elem[i], j, ptr, end))return false;
+        return true;
+    }
+
+    const cl_uint one = 1;  bool little = *reinterpret_cast<const char *>(&one);
+    bool swap = header.format == (little ? ply_binary_be : ply_binary_le);
+    for(size_t i = 0; i < header.elem_count; i++)
     {
-        vtx[i].norm = Vector(0, 0, 0);  vtx[i].index = -1;
+        bool res = swap ? read_binary<true>(header.elem[i], ptr, end) : read_binary<false>(header.elem[i], ptr, end);
+        if(!res)return false;
     }
-    Vector min, max;  init_bounds(min, max);
+    return true;
+}
+
+
+bool Model::load(const char *file, ThreadPool *pool)
+{
+    assert(!vtx && !tri);  MappedFile input;  if(!input.open(file))return false;
+    PlyHeader header;  const char *ptr = header.parse(input.begin(), input.end());  if(!ptr)return false;
+    vtx_count = header.vertex->count;  tri_count = header.face->count;  if(!vtx_count || !tri_count)return false;
+
+    vtx = new ModelVertex[vtx_count];  tri = new Triangle[tri_count];
+    PlyReader reader(vtx, vtx_count, tri);  if(!reader.read(header, ptr, input.end(), pool))return false;
+    prepare();  return true;
+}
+
+bool Model::save(const char *file) const
+{
+    FILE *output = fopen(file, "wb");  if(!output)return false;
+    const cl_uint one = 1;  bool little = *reinterpret_cast<const char *>(&one);
+    fprintf(output, "ply\nformat %s 1.0\nelement vertex %zu\n"
+        "property float x\nproperty float y\nproperty float z\nelement face %zu\n"
+        "property list uchar int vertex_indices\nend_header\n",
+        little ? "binary_little_endian" : "binary_big_endian", vtx_count, tri_count);
+
+    bool res = true;
+    for(size_t i = 0; i < vtx_count && res; i++)
+    {
+        cl_float pos[3] = {vtx[i].pos.x, vtx[i].pos.y, vtx[i].pos.z};
+        res = fwrite(pos, sizeof(pos), 1, output) == 1;
+    }
+    for(size_t i = 0; i < tri_count && res; i++)
+    {
+        char buf[13];  buf[0] = 3;
+        for(int k = 0; k < 3; k++)
+        {
+            int index = tri[i].pt[k] - vtx;  memcpy(buf + 1 + 4 * k, &index, 4);
+        }
+        res = fwrite(buf, sizeof(buf), 1, output) == 1;
+    }
+    return !fclose(output) && res;
+}
+
+void Model::prepare()
+{
+    assert(!root);
+    for(size_t i = 0; i < vtx_count; i++)vtx[i].norm = Vector(0, 0, 0);
+    Vector min, max;  init_bounds(min, max);  build.alloc(tri, tri_count);
     for(size_t i = 0; i < tri_count; i++)
     {
         Vector pt[3] = {tri[i].pt[0]->pos, tri[i].pt[1]->pos, tri[i].pt[2]->pos};
-        tri[i].center = (pt[0] + pt[1] + pt[2]) / 3;  Vector norm = (pt[1] - pt[0]) % (pt[2] - pt[0]);
+        Vector center = (pt[0] + pt[1] + pt[2]) / 3, norm = (pt[1] - pt[0]) % (pt[2] - pt[0]);
         tri[i].pt[0]->norm += norm;  tri[i].pt[1]->norm += norm;  tri[i].pt[2]->norm += norm;
-        update_bounds(min, max, tri[i].center);  tri_ptr[i] = &tri[i];
+        tri[i].min = vec_min(vec_min(pt[0], pt[1]), pt[2]);  tri[i].max = vec_max(vec_max(pt[0], pt[1]), pt[2]);
+        build.set(i, i, center);  update_bounds(min, max, center);
     }
     for(size_t i = 0; i < vtx_count; i++)vtx[i].norm /= vtx[i].norm.len();
-    root = new TriangleBlock(min, max, tri_ptr, tri_count);
+    root = new TriangleBlock(min, max, &build, 0, tri_count);
 }
 
 void Model::put(AABB &aabb, const Matrix &mat, cl_uint local_id)
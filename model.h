@@ -1,7 +1,10 @@
 // model.h -- header file
 //
 
+#pragma once
+
 #include "vec3d.h"
+#include "thread-pool.h"
 #include <CL/opencl.h>
 #include "ray-tracer.h"
 #include <algorithm>
@@ -12,42 +15,75 @@
 
 inline cl_uint make_group_id(size_t index, int transform, int shader)
 {
-    return index | transform << GROUP_TR_SHIFT | shader << GROUP_SH_SHIFT;
+    return index | cl_uint(transform) << GROUP_TR_SHIFT | cl_uint(shader) << GROUP_SH_SHIFT;
 }
 
 
+struct ResourceCount
+{
+    cl_uint grp, aabb, vtx, tri, rec;  // tri -- words in triangle buffer, rec -- float4s in record buffer
+
+    ResourceCount() : grp(0), aabb(0), vtx(0), tri(0), rec(0)
+    {
+    }
+
+    ResourceCount(cl_uint grp_, cl_uint aabb_, cl_uint vtx_, cl_uint tri_, cl_uint rec_ = 0) :
+        grp(grp_), aabb(aabb_), vtx(vtx_), tri(tri_), rec(rec_)
+    {
+    }
+
+    ResourceCount operator + (const ResourceCount &cnt) const
+    {
+        return ResourceCount(grp + cnt.grp, aabb + cnt.aabb, vtx + cnt.vtx, tri + cnt.tri, rec + cnt.rec);
+    }
+};
+
+struct SceneData  // final scene arrays as uploaded to device
+{
+    Group *grp;  AABB *aabb;  Vertex *vtx;  cl_uint *tri;  cl_float4 *rec;
+    size_t grp_count, aabb_count, vtx_count, tri_count, rec_count;
+    cl_uint root_group;  // instance AABBs
+
+    size_t memory_size() const
+    {
+        return grp_count * sizeof(Group) + aabb_count * sizeof(AABB) + vtx_count * sizeof(Vertex) +
+            tri_count * sizeof(cl_uint) + rec_count * sizeof(cl_float4);
+    }
+};
+
 class ResourceManager
 {
-    Group *grp_;  AABB *aabb_;  Vertex *vtx_;  cl_uint *tri_;
-    size_t grp_count_, aabb_count_, vtx_count_, tri_count_;
-    cl_uint grp_pos_, aabb_pos_, vtx_pos_, tri_pos_;
+    Group *grp_;  AABB *aabb_;  Vertex *vtx_;  cl_uint *tri_;  cl_float4 *rec_;
+    size_t grp_count_, aabb_count_, vtx_count_, tri_count_, rec_count_;
+    cl_uint grp_pos_, aabb_pos_, vtx_pos_, tri_pos_, rec_pos_;
 
 
 public:
-    ResourceManager() : grp_(0), aabb_(0), vtx_(0), tri_(0),
-        grp_count_(0), aabb_count_(0), vtx_count_(0), tri_count_(0),
-        grp_pos_(0), aabb_pos_(0), vtx_pos_(0), tri_pos_(0)
+    ResourceManager() : grp_(0), aabb_(0), vtx_(0), tri_(0), rec_(0),
+        grp_count_(0), aabb_count_(0), vtx_count_(0), tri_count_(0), rec_count_(0),
+        grp_pos_(0), aabb_pos_(0), vtx_pos_(0), tri_pos_(0), rec_pos_(0)
     {
     }
 
     ~ResourceManager()
     {
-        delete [] grp_;  delete [] aabb_;  delete [] vtx_;  delete [] tri_;
+        delete [] grp_;  delete [] aabb_;  delete [] vtx_;  delete [] tri_;  delete [] rec_;
     }
 
     void alloc()
     {
-        assert(!grp_ && !aabb_ && !vtx_ && !tri_);
+        assert(!grp_ && !aabb_ && !vtx_ && !tri_ && !rec_);
         if(grp_count_)grp_ = new Group[grp_count_];
         if(aabb_count_)aabb_ = new AABB[aabb_count_];
         if(vtx_count_)vtx_ = new Vertex[vtx_count_];
         if(tri_count_)tri_ = new cl_uint[tri_count_];
+        if(rec_count_)rec_ = new cl_float4[rec_count_];
     }
 
     bool full() const
     {
         return grp_pos_ == grp_count_ && aabb_pos_ == aabb_count_ &&
-            vtx_pos_ == vtx_count_ && tri_pos_ == tri_count_;
+            vtx_pos_ == vtx_count_ && tri_pos_ == tri_count_ && rec_pos_ == rec_count_;
     }
 
 
@@ -71,6 +107,11 @@ public:
         assert(tri_ && index < tri_pos_);  return tri_ + index;
     }
 
+    cl_float4 *record(size_t index)
+    {
+        assert(rec_ && index < rec_pos_);  return rec_ + index;
+    }
+
 
     size_t group_count() const
     {
@@ -92,6 +133,30 @@ public:
         return tri_count_;
     }
 
+    size_t record_count() const
+    {
+        return rec_count_;
+    }
+
+    size_t memory_size() const
+    {
+        return grp_count_ * sizeof(Group) + aabb_count_ * sizeof(AABB) + vtx_count_ * sizeof(Vertex) +
+            tri_count_ * sizeof(cl_uint) + rec_count_ * sizeof(cl_float4);
+    }
+
+    SceneData scene_data(cl_uint root_group)
+    {
+        assert(full());
+        SceneData res = {grp_, aabb_, vtx_, tri_, rec_, grp_count_, aabb_count_, vtx_count_, tri_count_, rec_count_, root_group};
+        return res;
+    }
+
+
+    void reserve(const ResourceCount &n)
+    {
+        reserve_groups(n.grp);  reserve_aabbs(n.aabb);  reserve_vertices(n.vtx);
+        reserve_triangles(n.tri);  reserve_records(n.rec);
+    }
 
     void reserve_groups(size_t n)
     {
@@ -113,6 +178,17 @@ public:
         assert(!tri_);  tri_count_ += n;
     }
 
+    void reserve_records(size_t n)
+    {
+        assert(!rec_);  rec_count_ += n;
+    }
+
+
+    ResourceCount get(const ResourceCount &n)  // contiguous ranges, subranges can be filled concurrently
+    {
+        return ResourceCount(get_groups(n.grp), get_aabbs(n.aabb),
+            get_vertices(n.vtx), get_triangles(n.tri), get_records(n.rec));
+    }
 
     cl_uint get_groups(size_t n)
     {
@@ -137,6 +213,12 @@ public:
         assert(!n || tri_ && tri_pos_ + n <= tri_count_);
         cl_uint res = tri_pos_;  tri_pos_ += n;  return res;
     }
+
+    cl_uint get_records(size_t n)
+    {
+        assert(!n || rec_ && rec_pos_ + n <= rec_count_);
+        cl_uint res = rec_pos_;  rec_pos_ += n;  return res;
+    }
 };
 
 
@@ -190,98 +272,185 @@ void set_camera(Camera &cam, size_t width, size_t height, cl_float tan_fov,
 struct ModelVertex
 {
     Vector pos, norm;
-    int index;
 };
 
 struct Triangle
 {
-    Vector center;
     ModelVertex *pt[3];
+    Vector min, max;
 };
 
-struct TriangleCompare
+enum TriangleFormat
 {
-    cl_float Vector::*axis;
+    tf_packed, tf_wide, tf_record, tf_record_norm  // tf_packed falls back to tf_wide for leaves above 10-bit limit
+};
+
+struct BuildSettings
+{
+    size_t tri_threshold, aabb_threshold;
+    size_t max_fanout;  // maximal AABB count of group, 0 -- unlimited, more than MAX_HITS can lose hits
+    bool sah;  size_t bin_count;  // binned surface area heuristic instead of median split
+    cl_float leaf_cost, traversal_cost;  // SAH costs of one triangle test and of one node visit
+    size_t task_threshold;  // minimal triangle count of a subtree processed as a separate task
+    TriangleFormat tri_format;
+    bool quantize;  // 8-bit AABBs relative to group box
+
+    BuildSettings() : tri_threshold(128), aabb_threshold(128), max_fanout(MAX_HITS),
+        sah(false), bin_count(16), leaf_cost(1), traversal_cost(64), task_threshold(4096), tri_format(tf_packed), quantize(false)
+    {
+    }
+};
+
+inline bool mesh_indices_fit(size_t tri_count, TriangleFormat format)  // index formats address 1 << MESH_WIDE_INDEX_BITS vertices
+{
+    return format == tf_record || format == tf_record_norm || 3 * tri_count <= (size_t(1) << MESH_WIDE_INDEX_BITS);
+}
+
+class BuildData  // triangle indices and centroids in build order, permuted together
+{
+    const Triangle *tri;  cl_uint *index;  cl_float *center[3];
+
+public:
+    BuildData() : tri(0), index(0)
+    {
+        center[0] = center[1] = center[2] = 0;
+    }
+
+    ~BuildData()
+    {
+        delete [] index;  for(int k = 0; k < 3; k++)delete [] center[k];
+    }
+
+    void alloc(const Triangle *tri_, size_t count);
+
+    const Triangle &triangle(size_t i) const
+    {
+        return tri[index[i]];
+    }
 
-    TriangleCompare(cl_float Vector::*axis_) : axis(axis_)
+    Vector centroid(size_t i) const
     {
+        return Vector(center[0][i], center[1][i], center[2][i]);
     }
 
-    bool operator () (const Triangle *tri1, const Triangle *tri2)
+    cl_float centroid(size_t i, int axis) const
     {
-        return tri1->center.*axis < tri2->center.*axis;
+        return center[axis][i];
     }
+
+    void set(size_t i, cl_uint tri_index, const Vector &pos)
+    {
+        index[i] = tri_index;  center[0][i] = pos.x;  center[1][i] = pos.y;  center[2][i] = pos.z;
+    }
+
+    void swap(size_t i, size_t j)
+    {
+        std::swap(index[i], index[j]);  for(int k = 0; k < 3; k++)std::swap(center[k][i], center[k][j]);
+    }
+
+    void select(size_t begin, size_t end, size_t nth, int axis);  // quickselect, average O(n)
+    template<typename P> size_t partition(size_t begin, size_t end, const P &pred);  // pred(i), returns split point
 };
 
 
 class TriangleBlock
 {
-    Triangle **tri;
-    size_t aabb_count, vtx_count, tri_count;
+    BuildData *data;  size_t offs;  ModelVertex **vtx;  // vtx -- sorted unique leaf vertices
+    size_t aabb_count, vtx_count, tri_count, entry_count;  // entry_count -- AABBs in parent group
+    ShaderType shader;  // leaf triangle format
     TriangleBlock *child[2];
     Vector min, max;
+    ResourceCount total;
+
+
+    size_t split_median();
+    size_t split_sah(const BuildSettings &settings);
 
+    size_t seal()  // turn inner node into group
+    {
+        assert(child[0] && entry_count > 1);  aabb_count = entry_count;  return entry_count = 1;
+    }
 
 public:
-    TriangleBlock(const Vector &min_, const Vector &max_, Triangle **ptr, size_t count) :
-        tri(ptr), aabb_count(0), vtx_count(0), tri_count(count), min(min_), max(max_)
+    TriangleBlock(const Vector &min_, const Vector &max_, BuildData *data_, size_t offs_, size_t count) :
+        data(data_), offs(offs_), vtx(0), aabb_count(0), vtx_count(0), tri_count(count), entry_count(1), shader(sh_mesh), min(min_), max(max_)
     {
         child[0] = child[1] = 0;
     }
 
     ~TriangleBlock()
     {
-        delete child[0];  delete child[1];
+        delete [] vtx;  delete child[0];  delete child[1];
     }
 
 
-    size_t subdivide(size_t tri_threshold, size_t aabb_threshold, bool root = true);  // returns aabb_count
+    size_t subdivide(const BuildSettings &settings, ThreadPool *pool = 0, bool root = true);  // returns entry_count
 
-    void reserve(ResourceManager &mngr);
-    cl_uint fill(ResourceManager &mngr, cl_uint material_id, cl_uint *aabb_index = 0);  // returns group_id
+    void reserve(const BuildSettings &settings, ThreadPool *pool = 0);
+    cl_uint fill(ResourceManager &mngr, const ResourceCount &pos, cl_uint material_id,
+        const BuildSettings &settings, ThreadPool *pool = 0, AABB *aabb = 0);  // returns group_id
+
+    const ResourceCount &resources() const  // valid after reserve
+    {
+        return total;
+    }
+
+    cl_float sah_cost(const BuildSettings &settings) const;  // valid after fill
 };
 
 
 class Model
 {
     ModelVertex *vtx;
-    Triangle *tri, **tri_ptr;
+    Triangle *tri;  BuildData build;
     size_t vtx_count, tri_count;
     TriangleBlock *root;
     cl_uint group_id;
+    BuildSettings settings;
 
 
     void prepare();
 
 
 public:
-    Model() : vtx(0), tri(0), tri_ptr(0), vtx_count(0), tri_count(0), root(0), group_id(0)
+    Model() : vtx(0), tri(0), vtx_count(0), tri_count(0), root(0), group_id(0)
     {
     }
 
     ~Model()
     {
-        delete [] vtx;  delete [] tri;  delete [] tri_ptr;  delete root;
+        delete [] vtx;  delete [] tri;  delete root;
     }
 
 
-    bool load(const char *file);
+    bool load(const char *file, ThreadPool *pool = 0);  // ASCII or binary PLY
+    bool save(const char *file) const;  // binary PLY in native byte order
 
-    void subdivide(size_t tri_threshold, size_t aabb_threshold)
+    size_t triangle_count() const
     {
-        root->subdivide(tri_threshold, aabb_threshold);
+        return tri_count;
     }
 
-    void reserve(ResourceManager &mngr)
+    void subdivide(const BuildSettings &settings_, ThreadPool *pool = 0)
     {
-        root->reserve(mngr);
+        settings = settings_;  root->subdivide(settings, pool);
     }
 
-    void fill(ResourceManager &mngr, cl_uint material_id)
+    void reserve(ResourceManager &mngr, ThreadPool *pool = 0)
     {
-        group_id = root->fill(mngr, material_id);
+        root->reserve(settings, pool);  mngr.reserve(root->resources());
+    }
+
+    void fill(ResourceManager &mngr, cl_uint material_id, ThreadPool *pool = 0)
+    {
+        group_id = root->fill(mngr, mngr.get(root->resources()), material_id, settings, pool);
     }
 
     void put(AABB &aabb, const Matrix &mat, cl_uint local_id);
+
+    cl_float sah_cost() const
+    {
+        return root->sah_cost(settings);
+    }
 };
 
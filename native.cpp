@@ -0,0 +1,778 @@
+// native.cpp -- host implementation of the tracing pipeline
+//
+
+#include "native.h"
+#include <cstring>
+#include <iostream>
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+
+
+// packet arithmetic, lane per ray
+
+#if defined(__AVX512F__)
+typedef __m512 vfloat;  typedef __mmask16 vmask;
+
+inline vfloat vsplat(float val)
+{
+    return _mm512_set1_ps(val);
+}
+
+inline vfloat vload(const float *ptr)  // aligned
+{
+    return _mm512_load_ps(ptr);
+}
+
+inline void vstore(float *ptr, vfloat val)
+{
+    _mm512_store_ps(ptr, val);
+}
+
+inline vfloat vmin(vfloat a, vfloat b)  // masked forms avoid spurious uninitialized warnings of GCC 12
+{
+    return _mm512_mask_min_ps(a, 0xFFFF, a, b);
+}
+
+inline vfloat vmax(vfloat a, vfloat b)
+{
+    return _mm512_mask_max_ps(a, 0xFFFF, a, b);
+}
+
+inline vmask vless(vfloat a, vfloat b)
+{
+    return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ);
+}
+
+inline vmask vless_equal(vfloat a, vfloat b)
+{
+    return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ);
+}
+
+inline vmask vand(vmask a, vmask b)
+{
+    return a & b;
+}
+
+inline unsigned vbits(vmask mask)
+{
+    return mask;
+}
+
+inline vfloat vselect(vfloat a, vfloat b, vmask mask)  // b where mask is set
+{
+    return _mm512_mask_blend_ps(mask, a, b);
+}
+#elif defined(__AVX2__)
+typedef __m256 vfloat;  typedef __m256 vmask;
+
+inline vfloat vsplat(float val)
+{
+    return _mm256_set1_ps(val);
+}
+
+inline vfloat vload(const float *ptr)
+{
+    return _mm256_load_ps(ptr);
+}
+
+inline void vstore(float *ptr, vfloat val)
+{
+    _mm256_store_ps(ptr, val);
+}
+
+inline vfloat vmin(vfloat a, vfloat b)
+{
+    return _mm256_min_ps(a, b);
+}
+
+inline vfloat vmax(vfloat a, vfloat b)
+{
+    return _mm256_max_ps(a, b);
+}
+
+inline vmask vless(vfloat a, vfloat b)
+{
+    return _mm256_cmp_ps(a, b, _CMP_LT_OQ);
+}
+
+inline vmask vless_equal(vfloat a, vfloat b)
+{
+    return _mm256_cmp_ps(a, b, _CMP_LE_OQ);
+}
+
+inline vmask vand(vmask a, vmask b)
+{
+    return _mm256_and_ps(a, b);
+}
+
+inline unsigned vbits(vmask mask)
+{
+    return _mm256_movemask_ps(mask);
+}
+
+inline vfloat vselect(vfloat a, vfloat b, vmask mask)
+{
+    return _mm256_blendv_ps(a, b, mask);
+}
+#else
+typedef float vfloat;  typedef bool vmask;
+
+inline vfloat vsplat(float val)
+{
+    return val;
+}
+
+inline vfloat vload(const float *ptr)
+{
+    return *ptr;
+}
+
+inline void vstore(float *ptr, vfloat val)
+{
+    *ptr = val;
+}
+
+inline vfloat vmin(vfloat a, vfloat b)
+{
+    return b < a ? b : a;
+}
+
+inline vfloat vmax(vfloat a, vfloat b)
+{
+    return b > a ? b : a;
+}
+
+inline vmask vless(vfloat a, vfloat b)
+{
+    return a < b;
+}
+
+inline vmask vless_equal(vfloat a, vfloat b)
+{
+    return a <= b;
+}
+
+inline vmask vand(vmask a, vmask b)
+{
+    return a && b;
+}
+
+inline unsigned vbits(vmask mask)
+{
+    return mask;
+}
+
+inline vfloat vselect(vfloat a, vfloat b, vmask mask)
+{
+    return mask ? b : a;
+}
+#endif
+
+#define PACKET_WIDTH  (sizeof(vfloat) / sizeof(float))
+
+const size_t NativeTracer::packet_width = PACKET_WIDTH;
+
+inline unsigned lowest_bit(unsigned bits)
+{
+    return __builtin_ctz(bits);
+}
+
+
+
+// scalar helpers, same expressions as in the kernels
+
+#define SKY_COLOR    Vector(0.5, 1.0, 1.0)
+#define LIGHT_COLOR  Vector(1, 1, 1)
+#define LIGHT_DIR    normalize(Vector(1, -1, 1))
+
+inline Vector to_vector(const cl_float4 &vec)
+{
+    return Vector(vec.s[0], vec.s[1], vec.s[2]);
+}
+
+inline void set_xyz(cl_float4 &res, const Vector &vec)
+{
+    res.s[0] = vec.x;  res.s[1] = vec.y;  res.s[2] = vec.z;
+}
+
+inline void atomic_add(cl_float &val, cl_float add)  // rays of one pixel can finish in different threads
+{
+    cl_float old, res;  __atomic_load(&val, &old, __ATOMIC_RELAXED);
+    do res = old + add;
+    while(!__atomic_compare_exchange(&val, &old, &res, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+inline void add_color(cl_float4 &res, const cl_float4 &weight, const Vector &color)
+{
+    atomic_add(res.s[0], weight.s[0] * color.x);  atomic_add(res.s[1], weight.s[1] * color.y);
+    atomic_add(res.s[2], weight.s[2] * color.z);  atomic_add(res.s[3], weight.s[3]);
+}
+
+cl_uint deinterleave(cl_uint val, int shift)
+{
+    cl_uint res = (val >> shift) & 0x55555555;
+    res = (res | res >> 1) & 0x33333333;
+    res = (res | res >> 2) & 0x0F0F0F0F;
+    res = (res | res >> 4) & 0x00FF00FF;
+    res = (res | res >> 8) & 0x0000FFFF;
+    return res;
+}
+
+float subpixel(cl_uint val)
+{
+    val = (val % 15) + 1;
+    val = (val & 1) << 3 | (val & 2) << 1 | (val & 4) >> 1 | (val & 8) >> 3;
+    return (val - 0.5f) / 15;
+}
+
+Vector material_color(const MatShader &shader, const Vector &dir, const Vector &norm, const Vector &light)
+{
+    const float alpha = 100, f0 = 0.04;
+    Vector hvec = normalize(light - dir);
+    float spec = (alpha + 2) / 8 * pow(max(0.0f, norm * hvec), alpha);
+    spec *= f0 + (1 - f0) * pow(max(0.0f, -(dir * hvec)), 5.0f);
+    return (to_vector(shader.color) + Vector(1, 1, 1) * (spec * shader.color.s[3])) * max(0.0f, light * norm);
+}
+
+void transform_ray(const Matrix *mat_list, cl_uint group_id, const cl_uint2 &local_id,
+    const RayQueue &ray, Ray &res, Vector res_mat[4])
+{
+    res.start_min = ray.start_min;  res.dir_max = ray.dir_max;
+    if(((group_id >> GROUP_TR_SHIFT) & GROUP_TR_MASK) != tr_ortho)  // identity, no other types used
+    {
+        res_mat[0] = Vector(1, 0, 0);  res_mat[1] = Vector(0, 1, 0);
+        res_mat[2] = Vector(0, 0, 1);  res_mat[3] = Vector(0, 0, 0);  return;
+    }
+
+    const Matrix &mat = mat_list[local_id.s[0]];
+    res_mat[0] = Vector(mat.x.s[0], mat.y.s[0], mat.z.s[0]);
+    res_mat[1] = Vector(mat.x.s[1], mat.y.s[1], mat.z.s[1]);
+    res_mat[2] = Vector(mat.x.s[2], mat.y.s[2], mat.z.s[2]);
+    res_mat[3] = Vector(mat.x.s[3], mat.y.s[3], mat.z.s[3]);
+
+    Vector rel = to_vector(ray.start_min) - res_mat[3], dir = to_vector(ray.dir_max);
+    set_xyz(res.start_min, to_vector(mat.x) * rel.x + to_vector(mat.y) * rel.y + to_vector(mat.z) * rel.z);
+    set_xyz(res.dir_max, to_vector(mat.x) * dir.x + to_vector(mat.y) * dir.y + to_vector(mat.z) * dir.z);
+}
+
+void sort_hits(RayHit *hit, cl_uint n)  // same order as the kernel for equal positions
+{
+    if(n <= 8)
+    {
+        for(cl_uint i = 1; i < n; i++)
+        {
+            RayHit cur = hit[i];  cl_uint j = i;
+            for(; j && hit[j - 1].pos > cur.pos; j--)hit[j] = hit[j - 1];
+            hit[j] = cur;
+        }
+        return;
+    }
+    for(cl_uint base = 1; base < n; base *= 2)
+    {
+        for(cl_uint i = base; i < n; i++)if(i & base)
+        {
+            cl_uint j = i - 2 * (i & (base - 1)) - 1;
+            if(hit[j].pos > hit[i].pos)swap(hit[j], hit[i]);
+        }
+        for(cl_uint offs = base / 2; offs; offs /= 2)
+            for(cl_uint i = offs; i < n; i++)if(i & offs)
+            {
+                cl_uint j = i - offs;
+                if(hit[j].pos > hit[i].pos)swap(hit[j], hit[i]);
+            }
+    }
+}
+
+
+// ray state
+
+struct NativeTracer::Lane
+{
+    cl_uint index, offs;  Ray ray;  Vector mat[4];  bool any_hit;
+    RayHit head;  cl_uint hit_count;  RayHit hit[MAX_HITS + 1];  // aabb_shader output
+    cl_uint material_id, hit_index;  float pos;  Vector norm;  // mesh_shader output
+};
+
+struct alignas(64) NativeTracer::RayPacket
+{
+    float start[3][PACKET_WIDTH], inv_dir[3][PACKET_WIDTH], dir[3][PACKET_WIDTH];
+    float min[PACKET_WIDTH], max[PACKET_WIDTH], t_start[PACKET_WIDTH], any_hit[PACKET_WIDTH];
+};
+
+
+void NativeTracer::init(size_t warp_width_, size_t area_size_, const GlobalData &data_, const SceneData &scene,
+    const Matrix *mat, size_t mat_count, size_t thread_count, bool pin)
+{
+    assert(!pool);  pool = new ThreadPool(thread_count, pin);
+    ThreadStat zero_stat = {0, 0};  stat.assign(pool->thread_count(), zero_stat);
+
+    warp_width = warp_width_;  area_size = area_size_;  data = data_;
+    ray_count = data.ray_count;  group_count = data.group_count;
+
+    grp_data.resize(group_count);  ray_index[0].resize(ray_count);  ray_index[1].resize(ray_count);
+    ray_list.resize(ray_count);  queue_list.resize(ray_count * (MAX_QUEUE_LEN - 1));  area.resize(area_size);
+
+    Group zero;  memset(&zero, 0, sizeof(zero));  grp_list.assign(group_count, zero);
+    copy(scene.grp, scene.grp + scene.grp_count, grp_list.begin());
+    mat_list.assign(mat, mat + mat_count);
+    aabb_list.assign(scene.aabb, scene.aabb + scene.aabb_count);
+    vtx_list.assign(scene.vtx, scene.vtx + scene.vtx_count);
+    tri_list.assign(scene.tri, scene.tri + scene.tri_count);
+    rec_list.assign(scene.rec, scene.rec + scene.rec_count);
+}
+
+cl_uint NativeTracer::reset_ray(RayQueue &ray, cl_uint group_id, cl_uint local_id, cl_uint end_group)
+{
+    ray.head.group_id = group_id;  ray.head.local_id.s[0] = local_id;  ray.head.local_id.s[1] = 0;
+    ray.head.pos = ray.start_min.s[3] = 0.001f;  ray.dir_max.s[3] = INFINITY;
+    ray.queue_len = 1;  ray.material_id = end_group;  return group_id;
+}
+
+cl_uint NativeTracer::init_ray(RayQueue &ray, cl_uint pixel)
+{
+    const Camera &cam = data.cam;  const cl_uint total = cam.width * cam.height, sub = pixel / total;
+    pixel %= total;  ray.pixel = pixel;  for(int k = 0; k < 4; k++)ray.weight.s[k] = 1;
+    float x = pixel % cam.width + subpixel(deinterleave(sub, 0)), y = pixel / cam.width + subpixel(deinterleave(sub, 1));
+    Vector dir = normalize(to_vector(cam.top_left) + to_vector(cam.dx) * x + to_vector(cam.dy) * y);
+
+    ray.type = rt_primary;  ray.start_min.s[0] = cam.eye.s[0];  ray.start_min.s[1] = cam.eye.s[1];
+    ray.start_min.s[2] = cam.eye.s[2];  set_xyz(ray.dir_max, dir);
+    return reset_ray(ray, cam.root_group, cam.root_local, sky_group);
+}
+
+void NativeTracer::init_frame()
+{
+    for(size_t i = 0; i < group_count; i++)
+    {
+        grp_data[i].count.s[1] = 0;  grp_data[i].offset.s[1] = 0xFFFFFFFF;
+    }
+    for(size_t i = 0; i < ray_count; i++)
+    {
+        ray_index[0][i].s[0] = init_ray(ray_list[i], i);  ray_index[0][i].s[1] = i;
+    }
+    cl_float4 zero;  memset(&zero, 0, sizeof(zero));  area.assign(area_size, zero);
+    data.pixel_offset = ray_count;  data.pixel_count = 0;
+    data.done_count[rt_primary] = data.done_count[rt_shadow] = 0;  data.work_next = 0;
+    data.key_or = 0;  data.key_and = GROUP_ID_MASK;  data.sort_passes = data.lost_hits = 0;
+
+    GroupData all;  all.offset.s[0] = 0;  all.count.s[0] = ray_count;  // everything in root group
+    build_batches(&all, 1);
+}
+
+
+// shading and queue maintenance, port of trace_ray
+
+cl_uint NativeTracer::pop_queue(RayQueue &ray, RayHit *tail, cl_uint material_id, cl_uint queue_len)
+{
+    if(queue_len)
+    {
+        ray.start_min.s[3] = ray.head.pos;  ray.head = tail[queue_len - 1];  ray.queue_len = queue_len;
+    }
+    else
+    {
+        ray.head.group_id = material_id;  ray.head.local_id.s[0] = ray.head.local_id.s[1] = 0;
+    }
+    return ray.head.group_id;
+}
+
+cl_uint NativeTracer::insert_stop(RayQueue &ray, RayHit *tail, const Lane &cur, Counter &cnt)
+{
+    if(cur.any_hit)  // occluded, rest of the queue is irrelevant
+    {
+        atomic_add(area[ray.pixel].s[3], ray.weight.s[3]);  cnt.done[rt_shadow]++;  return pop_queue(ray, tail, spawn_group, 0);
+    }
+    set_xyz(ray.norm, cur.mat[0] * cur.norm.x + cur.mat[1] * cur.norm.y + cur.mat[2] * cur.norm.z);
+    ray.dir_max.s[3] = cur.pos;  ray.material_id = cur.material_id;
+    cl_uint queue_len = ray.queue_len - 1, n = 0;
+    while(n < queue_len && tail[queue_len - 1 - n].pos < cur.pos)n++;  // entries before hit
+    if(n < queue_len)for(cl_uint i = 0; i < n; i++)tail[i] = tail[queue_len - n + i];
+    return pop_queue(ray, tail, cur.material_id, n);
+}
+
+cl_uint NativeTracer::insert_hits(RayQueue &ray, RayHit *tail, Lane &cur)
+{
+    RayHit *new_hit = cur.hit, hit[MAX_QUEUE_LEN];  const cl_uint n = cur.hit_count;  sort_hits(new_hit, n);
+    cl_uint queue_len = 0, next = 0;  bool overflow = false;
+    for(cl_uint i = ray.queue_len - 1; i > 0 && !overflow; i--)
+    {
+        RayHit old = tail[i - 1];
+        while(next < n && new_hit[next].pos < old.pos && !overflow)
+        {
+            hit[queue_len++] = new_hit[next++];  overflow = queue_len == MAX_QUEUE_LEN;
+        }
+        if(overflow)break;
+        hit[queue_len++] = old;  overflow = queue_len == MAX_QUEUE_LEN;
+    }
+    while(next < n && !overflow)
+    {
+        hit[queue_len++] = new_hit[next++];  overflow = queue_len == MAX_QUEUE_LEN;
+    }
+    if(overflow)
+    {
+        hit[MAX_QUEUE_LEN - 1].group_id = data.cam.root_group;
+        hit[MAX_QUEUE_LEN - 1].local_id.s[0] = data.cam.root_local;  hit[MAX_QUEUE_LEN - 1].local_id.s[1] = 0;
+    }
+
+    if(!queue_len)return pop_queue(ray, tail, ray.material_id, 0);
+    for(cl_uint i = 1; i < queue_len; i++)tail[queue_len - 1 - i] = hit[i];
+    ray.start_min.s[3] = ray.head.pos;  ray.head = hit[0];  ray.queue_len = queue_len;  return hit[0].group_id;
+}
+
+
+// geometry shaders, all lanes share the group
+
+void NativeTracer::aabb_packet(const RayPacket &packet, Lane *lane, size_t lane_count, const AABBShader &shader)
+{
+    const AABB *aabb = &aabb_list[shader.aabb_offs];
+    const QuantizedAABB *quant = reinterpret_cast<const QuantizedAABB *>(aabb + 1);
+    const bool quantized = shader.flags & f_quantized;
+    const cl_float *base = aabb[0].min.s, *scale = aabb[0].max.s;
+
+    vfloat start[3], inv_dir[3];
+    for(int k = 0; k < 3; k++)
+    {
+        start[k] = vload(packet.start[k]);  inv_dir[k] = vload(packet.inv_dir[k]);
+    }
+    const vfloat t_start = vload(packet.t_start), ray_max = vload(packet.max);
+
+    float restart[PACKET_WIDTH], t_min_lane[PACKET_WIDTH];
+    for(size_t i = 0; i < lane_count; i++)
+    {
+        lane[i].hit_count = 0;  restart[i] = INFINITY;
+    }
+    for(cl_uint i = 0; i < shader.aabb_count; i++)
+    {
+        float aabb_min[3], aabb_max[3];  cl_uint group_id, local_id;
+        if(quantized)
+        {
+            const QuantizedAABB &cur = quant[i];
+            for(int k = 0; k < 3; k++)
+            {
+                aabb_min[k] = float(cur.min >> 8 * k & 0xFF) * scale[k] + base[k];
+                aabb_max[k] = float(cur.max >> 8 * k & 0xFF) * scale[k] + base[k];
+            }
+            group_id = cur.group_id;  local_id = cur.local_id;
+        }
+        else
+        {
+            for(int k = 0; k < 3; k++)
+            {
+                aabb_min[k] = aabb[i].min.s[k];  aabb_max[k] = aabb[i].max.s[k];
+            }
+            group_id = aabb[i].group_id;  local_id = aabb[i].local_id;
+        }
+
+        vfloat lo[3], hi[3];  // slab test
+        for(int k = 0; k < 3; k++)
+        {
+            vfloat pos1 = (vsplat(aabb_min[k]) - start[k]) * inv_dir[k];
+            vfloat pos2 = (vsplat(aabb_max[k]) - start[k]) * inv_dir[k];
+            lo[k] = vmin(pos1, pos2);  hi[k] = vmax(pos1, pos2);
+        }
+        vfloat t_min = vmax(vmax(lo[0], lo[1]), lo[2]), t_max = vmin(vmin(hi[0], hi[1]), hi[2]);
+        unsigned bits = vbits(vand(vand(vless(t_min, t_max), vless(t_start, t_max)), vless(t_min, ray_max)));
+        if(!bits)continue;
+
+        vstore(t_min_lane, t_min);
+        for(; bits; bits &= bits - 1)
+        {
+            const unsigned k = lowest_bit(bits);  Lane &cur = lane[k];
+            RayHit res;  res.pos = max(t_min_lane[k], packet.t_start[k]);  res.group_id = group_id;
+            res.local_id.s[0] = shader.flags & f_local0 ? local_id : cur.head.local_id.s[0];
+            res.local_id.s[1] = shader.flags & f_local1 ? local_id : cur.head.local_id.s[1];
+            if(cur.hit_count < MAX_HITS)
+            {
+                cur.hit[cur.hit_count++] = res;  continue;
+            }
+
+            cl_uint far = 0;  // overflow: keep nearest hits
+            for(cl_uint j = 1; j < MAX_HITS; j++)if(cur.hit[j].pos > cur.hit[far].pos)far = j;
+            if(res.pos < cur.hit[far].pos)swap(cur.hit[far], res);
+            restart[k] = min(restart[k], res.pos);
+        }
+    }
+    for(size_t i = 0; i < lane_count; i++)
+    {
+        Lane &cur = lane[i];  if(!(restart[i] < INFINITY && restart[i] > packet.t_start[i]))continue;
+        RayHit &res = cur.hit[cur.hit_count++];  // revisit this group past the kept hits
+        res.pos = restart[i];  res.group_id = cur.head.group_id;  res.local_id = cur.head.local_id;
+    }
+}
+
+void NativeTracer::mesh_packet(const RayPacket &packet, Lane *lane, size_t lane_count, const MeshShader &shader, cl_uint type)
+{
+    const Vertex *vtx = &vtx_list[shader.vtx_offs];
+    const cl_uint *tri = tri_list.empty() ? 0 : &tri_list[shader.tri_offs];
+    const cl_float4 *rec = rec_list.empty() ? 0 : &rec_list[shader.tri_offs];
+    const cl_uint stride = type == sh_mesh_record_norm ? 4 : 3;
+
+    vfloat start[3], dir[3];
+    for(int k = 0; k < 3; k++)
+    {
+        start[k] = vload(packet.start[k]);  dir[k] = vload(packet.dir[k]);
+    }
+    const vfloat ray_min = vload(packet.min), any_hit = vload(packet.any_hit), zero = vsplat(0), one = vsplat(1);
+    vfloat best = vload(packet.max), best_u = zero, best_v = zero;
+
+    const unsigned all = (1u << PACKET_WIDTH) - 1;  // lanes done after any hit, unused lanes
+    unsigned done = all & ~((1u << lane_count) - 1);
+    for(size_t i = 0; i < lane_count; i++)lane[i].hit_index = 0xFFFFFFFF;
+    for(cl_uint i = 0; i < shader.tri_count; i++)
+    {
+        Vector r, p, q, n;
+        if(type == sh_mesh || type == sh_mesh_wide)
+        {
+            cl_uint index[3];
+            if(type == sh_mesh)for(int k = 0; k < 3; k++)index[k] = tri[i] >> MESH_INDEX_BITS * k & 0x3FF;
+            else
+            {
+                index[0] = tri[2 * i] & 0xFFFF;  index[1] = tri[2 * i] >> 16;  index[2] = tri[2 * i + 1];
+            }
+            r = to_vector(vtx[index[0]].pos);  p = to_vector(vtx[index[1]].pos) - r;  q = to_vector(vtx[index[2]].pos) - r;
+            n = p % q;
+        }
+        else
+        {
+            const cl_float4 *cur = rec + i * stride;
+            r = to_vector(cur[0]);  p = to_vector(cur[1]);  q = to_vector(cur[2]);  n = stride > 3 ? to_vector(cur[3]) : p % q;
+        }
+
+        vfloat rel[3] = {vsplat(r.x) - start[0], vsplat(r.y) - start[1], vsplat(r.z) - start[2]};
+        vfloat w = one / (dir[0] * vsplat(n.x) + dir[1] * vsplat(n.y) + dir[2] * vsplat(n.z));
+        vfloat t = (rel[0] * vsplat(n.x) + rel[1] * vsplat(n.y) + rel[2] * vsplat(n.z)) * w;
+        vmask hit = vand(vless(ray_min, t), vless(t, best));  if(!vbits(hit))continue;
+
+        vfloat dr[3] = {dir[1] * rel[2] - dir[2] * rel[1], dir[2] * rel[0] - dir[0] * rel[2], dir[0] * rel[1] - dir[1] * rel[0]};
+        vfloat u = (vsplat(-q.x) * dr[0] + vsplat(-q.y) * dr[1] + vsplat(-q.z) * dr[2]) * w;
+        vfloat v = (vsplat(p.x) * dr[0] + vsplat(p.y) * dr[1] + vsplat(p.z) * dr[2]) * w;
+        hit = vand(hit, vand(vand(vless_equal(zero, u), vless_equal(zero, v)), vless_equal(u + v, one)));
+        unsigned bits = vbits(hit);  if(!bits)continue;
+
+        best = vselect(best, t, hit);  best_u = vselect(best_u, u, hit);  best_v = vselect(best_v, v, hit);
+        for(unsigned k = bits; k; k &= k - 1)lane[lowest_bit(k)].hit_index = i;
+        vmask stop = vand(hit, vless(zero, any_hit));  if(!vbits(stop))continue;
+        best = vselect(best, vsplat(-INFINITY), stop);  // occluded lanes accept no more hits
+        done |= vbits(stop);  if(done == all)break;
+    }
+
+    float pos[PACKET_WIDTH], u[PACKET_WIDTH], v[PACKET_WIDTH];
+    vstore(pos, best);  vstore(u, best_u);  vstore(v, best_v);
+    for(size_t i = 0; i < lane_count; i++)
+    {
+        Lane &cur = lane[i];  cur.material_id = 0xFFFFFFFF;  if(cur.hit_index == 0xFFFFFFFF)continue;
+        cur.material_id = shader.material_id;  cur.pos = pos[i];  if(cur.any_hit)continue;  // no normal for occlusion
+
+        cl_uint index[3];  const cl_uint k = cur.hit_index;
+        if(type == sh_mesh)for(int j = 0; j < 3; j++)index[j] = tri[k] >> MESH_INDEX_BITS * j & 0x3FF;
+        else if(type == sh_mesh_wide)
+        {
+            index[0] = tri[2 * k] & 0xFFFF;  index[1] = tri[2 * k] >> 16;  index[2] = tri[2 * k + 1];
+        }
+        else for(int j = 0; j < 3; j++)memcpy(&index[j], &rec[k * stride + j].s[3], sizeof(cl_uint));
+        cur.norm = to_vector(vtx[index[0]].norm) * (1 - u[i] - v[i]) +
+            to_vector(vtx[index[1]].norm) * u[i] + to_vector(vtx[index[2]].norm) * v[i];
+    }
+}
+
+
+// pipeline
+
+cl_uint NativeTracer::trace_ray(size_t index, Counter &cnt)
+{
+    const cl_uint group_id = ray_index[0][index].s[0];  RayQueue &ray = ray_list[ray_index[0][index].s[1]];
+    const MatShader &shader = grp_list[group_id & GROUP_ID_MASK].material;
+    switch((group_id >> GROUP_SH_SHIFT) & GROUP_SH_MASK)
+    {
+    case sh_sky:
+        add_color(area[ray.pixel], ray.weight, SKY_COLOR);  cnt.done[rt_primary]++;
+        return ray.head.group_id = spawn_group;
+
+    case sh_light:
+        add_color(area[ray.pixel], ray.weight, LIGHT_COLOR);  cnt.done[rt_shadow]++;
+        return ray.head.group_id = spawn_group;
+
+    case sh_material:
+        {
+            const Vector light = LIGHT_DIR, dir = to_vector(ray.dir_max);
+            Vector color = material_color(shader, dir, normalize(to_vector(ray.norm)), light);
+            ray.weight.s[0] *= color.x;  ray.weight.s[1] *= color.y;  ray.weight.s[2] *= color.z;
+            ray.type = rt_shadow;  cnt.done[rt_primary]++;
+            set_xyz(ray.start_min, to_vector(ray.start_min) + dir * ray.dir_max.s[3]);  set_xyz(ray.dir_max, light);
+            return reset_ray(ray, data.cam.root_group, data.cam.root_local, light_group);
+        }
+
+    default:  // spawn and unused groups
+        return init_ray(ray, index + data.pixel_offset);
+    }
+}
+
+void NativeTracer::trace_packet(size_t begin, size_t end, Counter &cnt)
+{
+    const cl_uint group_id = ray_index[0][begin].s[0], shader = (group_id >> GROUP_SH_SHIFT) & GROUP_SH_MASK;
+    if(shader < sh_aabb)
+    {
+        for(size_t i = begin; i < end; i++)
+        {
+            cl_uint res = ray_index[0][i].s[0] = trace_ray(i, cnt);
+            cnt.key_or |= res & GROUP_ID_MASK;  cnt.key_and &= res & GROUP_ID_MASK;
+        }
+        return;
+    }
+
+    Lane lane[PACKET_WIDTH];  RayPacket packet;  const size_t n = end - begin;
+    for(size_t i = 0; i < PACKET_WIDTH; i++)
+    {
+        if(i >= n)  // unused lane, never hits
+        {
+            for(int k = 0; k < 3; k++)
+            {
+                packet.start[k][i] = 0;  packet.dir[k][i] = packet.inv_dir[k][i] = 1;
+            }
+            packet.min[i] = 0;  packet.max[i] = -INFINITY;  packet.t_start[i] = INFINITY;  packet.any_hit[i] = 1;  continue;
+        }
+
+        Lane &cur = lane[i];  cur.index = begin + i;  cur.offs = ray_index[0][cur.index].s[1];
+        const RayQueue &ray = ray_list[cur.offs];  cur.head = ray.head;  cur.any_hit = ray.type == rt_shadow;
+        transform_ray(&mat_list[0], group_id, ray.head.local_id, ray, cur.ray, cur.mat);
+        for(int k = 0; k < 3; k++)
+        {
+            packet.start[k][i] = cur.ray.start.s[k];  packet.dir[k][i] = cur.ray.dir.s[k];
+            packet.inv_dir[k][i] = 1 / cur.ray.dir.s[k];
+        }
+        packet.min[i] = cur.ray.min;  packet.max[i] = cur.ray.max;
+        packet.t_start[i] = max(cur.ray.min, ray.head.pos);  packet.any_hit[i] = cur.any_hit;
+    }
+
+    const Group &grp = grp_list[group_id & GROUP_ID_MASK];
+    if(shader == sh_aabb)aabb_packet(packet, lane, n, grp.aabb);
+    else mesh_packet(packet, lane, n, grp.mesh, shader);
+
+    for(size_t i = 0; i < n; i++)
+    {
+        Lane &cur = lane[i];  RayQueue &ray = ray_list[cur.offs];
+        RayHit *tail = &queue_list[cur.offs * (MAX_QUEUE_LEN - 1)];  cl_uint res;
+        if(shader == sh_aabb)res = insert_hits(ray, tail, cur);
+        else if(cur.material_id != 0xFFFFFFFF)res = insert_stop(ray, tail, cur, cnt);
+        else res = pop_queue(ray, tail, ray.material_id, ray.queue_len - 1);
+        ray_index[0][cur.index].s[0] = res;
+        cnt.key_or |= res & GROUP_ID_MASK;  cnt.key_and &= res & GROUP_ID_MASK;
+    }
+}
+
+void NativeTracer::trace_range(size_t begin, size_t end, Counter &cnt)
+{
+    for(size_t i = begin; i < end;)
+    {
+        size_t next = i + 1;  const cl_uint group_id = ray_index[0][i].s[0];  // sorted, equal groups adjacent
+        while(next < end && next - i < PACKET_WIDTH && ray_index[0][next].s[0] == group_id)next++;
+        trace_packet(i, next, cnt);  i = next;
+    }
+}
+
+void NativeTracer::process()
+{
+    Counter zero = {0, GROUP_ID_MASK, {0, 0}};  vector<Counter> cnt(pool->thread_count(), zero);
+    nsec_type start = get_time();
+    pool->run(batch.size(), [&](size_t i)
+        {
+            nsec_type begin = get_time();  size_t index = pool->current_index();
+            trace_range(batch[i].begin, batch[i].end, cnt[index]);
+            stat[index].busy += get_time() - begin;  stat[index].batch_count++;
+        });
+    process_time += get_time() - start;  step_count++;  batch_total += batch.size();
+
+    for(size_t i = 0; i < cnt.size(); i++)
+    {
+        data.key_or |= cnt[i].key_or;  data.key_and &= cnt[i].key_and;
+        data.done_count[rt_primary] += cnt[i].done[rt_primary];  data.done_count[rt_shadow] += cnt[i].done[rt_shadow];
+    }
+}
+
+cl_uint NativeTracer::ray_cost(cl_uint group_id) const
+{
+    const Group &grp = grp_list[group_id & GROUP_ID_MASK];
+    switch((group_id >> GROUP_SH_SHIFT) & GROUP_SH_MASK)
+    {
+    case sh_aabb:  return 1 + grp.aabb.aabb_count;
+    case sh_mesh:  case sh_mesh_wide:  case sh_mesh_record:  case sh_mesh_record_norm:  return 1 + grp.mesh.tri_count;
+    default:  return 1;
+    }
+}
+
+void NativeTracer::build_batches(const GroupData *grp, size_t count)
+{
+    double total = 0;
+    for(size_t i = 0; i < count; i++)
+        if(grp[i].count.s[0])total += double(grp[i].count.s[0]) * ray_cost(ray_index[0][grp[i].offset.s[0]].s[0]);
+    const double target = max(1.0, total / (pool->thread_count() * batch_per_thread));
+
+    batch.clear();  Batch cur = {0, 0};  double cur_cost = 0;
+    for(size_t i = 0; i < count; i++)
+    {
+        const cl_uint end = grp[i].offset.s[0] + grp[i].count.s[0];  if(!grp[i].count.s[0])continue;
+        const double cost = ray_cost(ray_index[0][grp[i].offset.s[0]].s[0]);
+        for(cl_uint pos = grp[i].offset.s[0]; pos < end;)
+        {
+            cl_uint take = cl_uint(ceil((target - cur_cost) / cost) + PACKET_WIDTH - 1) / PACKET_WIDTH * PACKET_WIDTH;
+            take = min(take, end - pos);  cur.end = pos += take;  cur_cost += take * cost;
+            if(cur_cost < target)continue;
+            batch.push_back(cur);  cur.begin = cur.end;  cur_cost = 0;
+        }
+    }
+    if(cur.end > cur.begin)batch.push_back(cur);
+}
+
+void NativeTracer::print_utilization() const
+{
+    if(!step_count)return;
+    cout << "Native threads: " << stat.size() << ", " << batch_total / step_count << " batches per step, busy time:";
+    for(size_t i = 0; i < stat.size(); i++)
+        cout << (i % 8 ? "  " : "\n    ") << i << ": " << 100.0 * stat[i].busy / process_time << "% (" << stat[i].batch_count << ")";
+    cout << endl;
+}
+
+void NativeTracer::sort()
+{
+    const cl_uint total = data.ray_count;  cl_uint2 *src = &ray_index[0][0], *dst = &ray_index[1][0];
+
+    // stable counting sort, count.s0 -- group end (count_groups)
+    for(size_t i = 0; i < group_count; i++)grp_data[i].count.s[0] = 0;
+    for(cl_uint i = 0; i < total; i++)grp_data[src[i].s[0] & GROUP_ID_MASK].count.s[0]++;
+    for(cl_uint i = 0, sum = 0; i < group_count; i++)
+    {
+        sum += grp_data[i].count.s[0];  grp_data[i].count.s[0] = sum;
+    }
+    for(cl_uint i = total; i-- > 0;)dst[--grp_data[src[i].s[0] & GROUP_ID_MASK].count.s[0]] = src[i];
+    for(cl_uint i = 0; i + 1 < group_count; i++)grp_data[i].count.s[0] = grp_data[i + 1].count.s[0];
+    grp_data[group_count - 1].count.s[0] = total;
+    copy(src + total, src + ray_count, dst + total);  swap(src, dst);
+
+    // update_groups: full warps in place, remainders deferred after ray_count
+    cl_uint base = 0, offset[2] = {0, 0};
+    for(size_t pos = 0; pos < group_count; pos++)
+    {
+        GroupData &grp = grp_data[pos];  cl_uint cur = grp.count.s[0] - base;
+        grp.base.s[0] = base;  grp.base.s[1] = grp.offset.s[1] - cur;  base = grp.count.s[0];
+        cl_uint count = cur + grp.count.s[1], rem = pos != group_count - 1 ? count % warp_width : count;
+        grp.count.s[0] = count - rem;  grp.count.s[1] = rem;
+        grp.offset.s[0] = offset[0];  grp.offset.s[1] = offset[1];  offset[0] += count - rem;  offset[1] += rem;
+    }
+    for(size_t pos = 0; pos < group_count; pos++)grp_data[pos].offset.s[1] += offset[0];
+    data.old_count = total;  data.ray_count = offset[0];
+    data.pixel_offset += data.pixel_count;  data.pixel_count = grp_data[0].count.s[0];
+    data.key_or = 0;  data.key_and = GROUP_ID_MASK;  data.work_next = 0;
+
+    // set_ray_index
+    for(cl_uint index = 0; index < ray_count; index++)
+    {
+        const GroupData &grp = grp_data[src[index].s[0] & GROUP_ID_MASK];
+        cl_uint pos = index - (index < total ? grp.base.s[0] : grp.base.s[1]);
+        pos += pos < grp.count.s[1] ? grp.offset.s[1] : grp.offset.s[0] - grp.count.s[1];
+        dst[pos] = src[index];  // back to ray_index[0]
+    }
+    build_batches(&grp_data[0], group_count);
+}
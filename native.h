@@ -0,0 +1,99 @@
+// native.h -- host implementation of the tracing pipeline
+//
+
+#pragma once
+
+#include "model.h"
+#include "timer.h"
+#include <vector>
+
+
+
+class NativeTracer  // kernels of ray-tracer.cl on host memory, same data layout (AoS rays)
+{
+    struct alignas(64) Counter  // process results of a ray range, one per thread
+    {
+        cl_uint key_or, key_and, done[2];
+    };
+
+    struct alignas(64) ThreadStat
+    {
+        nsec_type busy;  size_t batch_count;
+    };
+
+    struct Batch  // ray range of one task: part of a large group or several small ones
+    {
+        cl_uint begin, end;
+    };
+
+    struct Lane;  // ray of packet
+    struct RayPacket;  // transformed rays of the same group, one SIMD lane per ray
+
+
+    size_t warp_width, area_size, ray_count, group_count;
+    GlobalData data;  std::vector<GroupData> grp_data;  std::vector<cl_uint2> ray_index[2];
+    std::vector<RayQueue> ray_list;  std::vector<RayHit> queue_list;  std::vector<cl_float4> area;
+    std::vector<Group> grp_list;  std::vector<Matrix> mat_list;  std::vector<AABB> aabb_list;
+    std::vector<Vertex> vtx_list;  std::vector<cl_uint> tri_list;  std::vector<cl_float4> rec_list;
+
+    ThreadPool *pool;  std::vector<Batch> batch;
+    std::vector<ThreadStat> stat;  nsec_type process_time;  size_t step_count, batch_total;
+
+
+    cl_uint reset_ray(RayQueue &ray, cl_uint group_id, cl_uint local_id, cl_uint end_group);
+    cl_uint init_ray(RayQueue &ray, cl_uint pixel);
+    cl_uint pop_queue(RayQueue &ray, RayHit *tail, cl_uint material_id, cl_uint queue_len);
+    cl_uint insert_stop(RayQueue &ray, RayHit *tail, const Lane &cur, Counter &cnt);
+    cl_uint insert_hits(RayQueue &ray, RayHit *tail, Lane &cur);
+
+    void aabb_packet(const RayPacket &packet, Lane *lane, size_t lane_count, const AABBShader &shader);
+    void mesh_packet(const RayPacket &packet, Lane *lane, size_t lane_count, const MeshShader &shader, cl_uint type);
+    cl_uint trace_ray(size_t index, Counter &cnt);  // non-geometry shaders
+    void trace_packet(size_t begin, size_t end, Counter &cnt);
+    void trace_range(size_t begin, size_t end, Counter &cnt);
+
+    cl_uint ray_cost(cl_uint group_id) const;
+    void build_batches(const GroupData *grp, size_t count);  // count.s0 rays at offset.s0 per group, groups adjacent
+
+public:
+    static const size_t packet_width;  // 16 -- AVX-512, 8 -- AVX2, 1 -- scalar
+    static const size_t batch_per_thread = 16;  // tasks per thread and step, for balance across groups
+
+    NativeTracer() : warp_width(0), area_size(0), ray_count(0), group_count(0),
+        pool(0), process_time(0), step_count(0), batch_total(0)
+    {
+    }
+
+    ~NativeTracer()
+    {
+        delete pool;
+    }
+
+    void init(size_t warp_width_, size_t area_size_, const GlobalData &data_, const SceneData &scene,
+        const Matrix *mat, size_t mat_count, size_t thread_count, bool pin);  // copies scene, data_.group_count and ray_count -- buffer sizes
+
+    void init_frame();  // init_groups, init_rays, init_image
+    void process();
+    void sort();  // stable sort by group, count_groups, update_groups, set_ray_index
+    void print_utilization() const;
+
+    void set_camera(const Camera &cam)  // takes effect at init_frame
+    {
+        data.cam = cam;
+    }
+
+    size_t thread_count() const
+    {
+        return stat.size();
+    }
+
+    const GlobalData &global_data() const
+    {
+        return data;
+    }
+
+    const cl_float4 *area_data() const
+    {
+        return &area[0];
+    }
+};
@@ -7,12 +7,37 @@
 #include "sort.cl"
 
 
-uint reset_ray(global RayQueue *ray, uint group_id, uint2 local_id, uint end_group)
+// ray state access, RAY_SOA -- separate array per field, RAY_COUNT rays
+
+#ifdef RAY_SOA
+typedef struct
+{
+    float4 weight[RAY_COUNT];
+    uint pixel[RAY_COUNT], type[RAY_COUNT], material_id[RAY_COUNT], queue_len[RAY_COUNT];
+    float4 start_min[RAY_COUNT], dir_max[RAY_COUNT];
+    float3 norm[RAY_COUNT];
+    RayHit head[RAY_COUNT];
+} RayList;
+
+#define RAY_PARAM       global RayList *ray_list, uint ray_offs
+#define RAY_ARGS        ray_list, ray_offs
+#define RAY_INIT(offs)  const uint ray_offs = (offs)
+#define RAY(field)      ray_list->field[ray_offs]
+#else
+typedef RayQueue RayList;
+
+#define RAY_PARAM       global RayQueue *ray
+#define RAY_ARGS        ray
+#define RAY_INIT(offs)  global RayQueue *ray = &ray_list[offs]
+#define RAY(field)      ray->field
+#endif
+
+
+uint reset_ray(RAY_PARAM, uint group_id, uint2 local_id, uint end_group)
 {
-    ray->orig.group_id = ray->queue[0].group_id = group_id;
-    ray->orig.local_id = ray->queue[0].local_id = local_id;
-    ray->queue[0].pos = ray->ray.min = 0.001;  ray->ray.max = INFINITY;
-    ray->queue_len = 1;  ray->material_id = end_group;  return group_id;
+    RAY(head).group_id = group_id;  RAY(head).local_id = local_id;
+    RAY(head).pos = RAY(start_min).w = 0.001;  RAY(dir_max).w = INFINITY;
+    RAY(queue_len) = 1;  RAY(material_id) = end_group;  return group_id;
 }
 
 
@@ -53,10 +78,9 @@ float subpixel(uint val)
     return (val - 0.5) / 15;
 }
 
-uint init_ray(const global GlobalData *data, global RayQueue *ray, uint pixel)
+uint camera_ray(const global Camera *cam, uint pixel, float3 *dir)  // returns image pixel
 {
     //pixel = calc_crc(pixel);
-    const global Camera *cam = &data->cam;
     const uint total = cam->width * cam->height;
     //if(pixel >= total)return data->group_count - 1;  // dead ray
     uint2 sub = deinterleave(pixel / total);  pixel %= total;
@@ -65,20 +89,26 @@ uint init_ray(const global GlobalData *data, global RayQueue *ray, uint pixel)
     //pixel %= cam->width * cam->height;
     //pixel = calc_crc(pixel) % (cam->width * cam->height);
     //float x = pixel % cam->width + 0.5, y = pixel / cam->width + 0.5;
-    ray->pixel = pixel;  ray->weight = 1;
+    *dir = normalize(cam->top_left + x * cam->dx + y * cam->dy);  return pixel;
+}
+
+uint init_ray(const global GlobalData *data, RAY_PARAM, uint pixel)
+{
+    const global Camera *cam = &data->cam;  float3 dir;
+    RAY(pixel) = camera_ray(cam, pixel, &dir);  RAY(weight) = 1;
 
-    ray->type = rt_primary;  ray->ray.start_min.xyz = cam->eye;
-    ray->ray.dir_max.xyz = normalize(cam->top_left + x * cam->dx + y * cam->dy);
-    return reset_ray(ray, ray->root.group_id = cam->root_group,
-        ray->root.local_id = (uint2)(cam->root_local, 0), sky_group);
+    RAY(type) = rt_primary;  RAY(start_min).xyz = cam->eye;  RAY(dir_max).xyz = dir;
+    return reset_ray(RAY_ARGS, cam->root_group, (uint2)(cam->root_local, 0), sky_group);
 }
 
-KERNEL void init_rays(global GlobalData *data, global RayQueue *ray_list, global uint2 *ray_index)
+KERNEL void init_rays(global GlobalData *data, global RayList *ray_list, global uint2 *ray_index)
 {
-    const uint index = get_global_id(0);
-    uint group_id = init_ray(data, &ray_list[index], index);
+    const uint index = get_global_id(0);  RAY_INIT(index);
+    uint group_id = init_ray(data, RAY_ARGS, index);
     ray_index[index] = (uint2)(group_id, index);  if(index)return;
     data->pixel_offset = get_global_size(0);  data->pixel_count = 0;
+    data->done_count[rt_primary] = data->done_count[rt_shadow] = 0;  data->work_next = 0;
+    data->key_or = 0;  data->key_and = GROUP_ID_MASK;
 }
 
 KERNEL void init_image(global float4 *area)
@@ -109,6 +139,16 @@ void bitonic_step(RayHit *hit, uint offs, uint n)
 
 void sort_hits(RayHit *hit, uint n)
 {
+    if(n <= 8)  // insertion sort for bounded fanout groups
+    {
+        for(uint i = 1; i < n; i++)
+        {
+            RayHit cur = hit[i];  uint j = i;
+            for(; j && hit[j - 1].pos > cur.pos; j--)hit[j] = hit[j - 1];
+            hit[j] = cur;
+        }
+        return;
+    }
     for(uint base = 1; base < n; base *= 2)
     {
         bitonic_flip(hit, base, n);
@@ -116,107 +156,101 @@ void sort_hits(RayHit *hit, uint n)
     }
 }
 
-KERNEL void process(global GlobalData *data, global float4 *area,
-    global RayQueue *ray_list, global uint2 *ray_index,
+uint trace_ray(global GlobalData *data, global float4 *area,
+    global RayList *ray_list, global uint2 *ray_index,
     const global Group *grp_list, const global Matrix *mat_list,
-    const global AABB *aabb, const global Vertex *vtx, const global uint *tri)
+    const global AABB *aabb, const global Vertex *vtx, const global uint *tri, const global float4 *rec,
+    global RayHit *queue_list, local uint *done, uint index)  // done[2] -- finished rays by type
 {
-    const uint index = get_global_id(0);  if(index >= data->ray_count)return;
     uint group_id  = ray_index[index].s0, offs = ray_index[index].s1;
-    global RayQueue *ray = &ray_list[offs];
+    RAY_INIT(offs);
+    global RayHit *tail = &queue_list[offs * (MAX_QUEUE_LEN - 1)];  // queue after head, nearest entry last
 
     Ray cur;  float3 mat[4];  uint queue_len, n, material_id;
-    transform(group_id, ray, &cur, mat, mat_list);
-    RayHit hit[MAX_QUEUE_LEN], new_hit[MAX_HITS];  float4 norm_pos;
+    transform(group_id, RAY_ARGS, &cur, mat, mat_list);  const bool any_hit = RAY(type) == rt_shadow;
+    RayHit hit[MAX_QUEUE_LEN], new_hit[MAX_HITS + 1];  float4 norm_pos;
     switch((group_id >> GROUP_SH_SHIFT) & GROUP_SH_MASK)
     {
     case sh_spawn:
-        group_id = init_ray(data, ray, index + data->pixel_offset);  goto assign_index;
+        group_id = init_ray(data, RAY_ARGS, index + data->pixel_offset);  goto assign_index;
 
     case sh_sky:
-        group_id = sky_shader(area, ray, &grp_list[group_id & GROUP_ID_MASK].material);  goto assign_index;
+        group_id = sky_shader(area, RAY_ARGS, &grp_list[group_id & GROUP_ID_MASK].material);
+        atomic_inc(&done[rt_primary]);  goto assign_index;
 
     case sh_light:
-        group_id = light_shader(area, ray, &grp_list[group_id & GROUP_ID_MASK].material);  goto assign_index;
+        group_id = light_shader(area, RAY_ARGS, &grp_list[group_id & GROUP_ID_MASK].material);
+        atomic_inc(&done[rt_shadow]);  goto assign_index;
 
     case sh_material:
-        group_id = mat_shader(area, ray, &grp_list[group_id & GROUP_ID_MASK].material);  goto assign_index;
+        group_id = mat_shader(area, RAY_ARGS, &grp_list[group_id & GROUP_ID_MASK].material, &data->cam);
+        atomic_inc(&done[rt_primary]);  goto assign_index;
 
     case sh_aabb:
-        n = aabb_shader(&cur, &grp_list[group_id & GROUP_ID_MASK].aabb, ray->queue, new_hit, aabb);
-        goto insert_hits;
+        {
+            RayHit head = RAY(head);
+            n = aabb_shader(&cur, &grp_list[group_id & GROUP_ID_MASK].aabb, &head, new_hit, aabb, &data->lost_hits);
+            goto insert_hits;
+        }
 
     case sh_mesh:
-        material_id = mesh_shader(&cur, &grp_list[group_id & GROUP_ID_MASK].mesh, &norm_pos, vtx, tri);
+        material_id = mesh_shader(&cur, &grp_list[group_id & GROUP_ID_MASK].mesh, &norm_pos, vtx, tri, false, any_hit);
+        if(material_id != 0xFFFFFFFF)goto insert_stop;  break;
+
+    case sh_mesh_wide:
+        material_id = mesh_shader(&cur, &grp_list[group_id & GROUP_ID_MASK].mesh, &norm_pos, vtx, tri, true, any_hit);
+        if(material_id != 0xFFFFFFFF)goto insert_stop;  break;
+
+    case sh_mesh_record:
+        material_id = mesh_record_shader(&cur, &grp_list[group_id & GROUP_ID_MASK].mesh, &norm_pos, vtx, rec, 3, any_hit);
+        if(material_id != 0xFFFFFFFF)goto insert_stop;  break;
+
+    case sh_mesh_record_norm:
+        material_id = mesh_record_shader(&cur, &grp_list[group_id & GROUP_ID_MASK].mesh, &norm_pos, vtx, rec, 4, any_hit);
         if(material_id != 0xFFFFFFFF)goto insert_stop;  break;
     }
 
-    queue_len = ray->queue_len - 1;
-    for(uint i = 0; i < queue_len; i++)hit[i] = ray->queue[i + 1];
+    material_id = RAY(material_id);  queue_len = RAY(queue_len) - 1;
 
-save_queue:
+pop_queue:  // queue_len -- entries in tail
     if(queue_len)
     {
-        ray->queue_len = queue_len;  ray->ray.min = ray->queue[0].pos;
+        RAY(start_min).w = RAY(head).pos;  RAY(head) = tail[queue_len - 1];  RAY(queue_len) = queue_len;
     }
     else
     {
-        hit[0].group_id = ray->material_id;  hit[0].local_id = 0;  queue_len = 1;
+        RAY(head).group_id = material_id;  RAY(head).local_id = 0;
     }
-
-copy_queue:
-    for(uint i = 0; i < queue_len; i++)ray->queue[i] = hit[i];  group_id = hit[0].group_id;
+    group_id = RAY(head).group_id;
 
 assign_index:
-    ray_index[index] = (uint2)(group_id, offs);  return;
+    ray_index[index] = (uint2)(group_id, offs);  return group_id;
 
 insert_stop:
-    if(ray->type == rt_shadow)
-    {
-        area[ray->pixel] += (float4)(0, 0, 0, ray->weight.w);  material_id = spawn_group;
-    }
-    else
-    {
-        ray->norm = mat[0] * norm_pos.x + mat[1] * norm_pos.y + mat[2] * norm_pos.z;
-        RayHit orig = {ray->ray.max = norm_pos.w, ray->queue[0].group_id, ray->queue[0].local_id};
-        ray->orig = orig;
-    }
-    queue_len = ray->queue_len - 1;
-    for(uint i = 0; i < queue_len; i++)
-    {
-        hit[i].pos = ray->queue[i + 1].pos;
-        if(hit[i].pos >= norm_pos.w)
-        {
-            queue_len = i;  break;
-        }
-        hit[i].group_id = ray->queue[i + 1].group_id;
-        hit[i].local_id = ray->queue[i + 1].local_id;
-    }
-    if(queue_len)
-    {
-        ray->queue_len = queue_len;  ray->ray.min = ray->queue[0].pos;
-    }
-    else
+    if(any_hit)  // occluded, rest of the queue is irrelevant
     {
-        hit[0].group_id = material_id;  hit[0].local_id = 0;  queue_len = 1;
+        area[RAY(pixel)] += (float4)(0, 0, 0, RAY(weight).w);  atomic_inc(&done[rt_shadow]);
+        material_id = spawn_group;  queue_len = 0;  goto pop_queue;
     }
-    ray->material_id = material_id;  goto copy_queue;
+    RAY(norm) = mat[0] * norm_pos.x + mat[1] * norm_pos.y + mat[2] * norm_pos.z;
+    RAY(dir_max).w = norm_pos.w;  RAY(material_id) = material_id;  queue_len = RAY(queue_len) - 1;  n = 0;
+    while(n < queue_len && tail[queue_len - 1 - n].pos < norm_pos.w)n++;  // entries before hit
+    if(n < queue_len)for(uint i = 0; i < n; i++)tail[i] = tail[queue_len - n + i];
+    queue_len = n;  goto pop_queue;
 
 insert_hits:
     sort_hits(new_hit, n);  queue_len = 0;
-    uint old_len = ray->queue_len, next = 0;
-    for(uint i = 1; i < old_len; i++)
+    uint old_len = RAY(queue_len) - 1, next = 0;
+    for(uint i = old_len; i > 0; i--)
     {
-        float pos = ray->queue[i].pos;
-        while(next < n && new_hit[next].pos < pos)
+        RayHit old = tail[i - 1];
+        while(next < n && new_hit[next].pos < old.pos)
         {
             hit[queue_len++] = new_hit[next++];
             if(queue_len == MAX_QUEUE_LEN)goto overflow;
         }
-        hit[queue_len].pos = pos;
-        if(++queue_len == MAX_QUEUE_LEN)goto overflow;
-        hit[queue_len - 1].group_id = ray->queue[i].group_id;
-        hit[queue_len - 1].local_id = ray->queue[i].local_id;
+        hit[queue_len++] = old;
+        if(queue_len == MAX_QUEUE_LEN)goto overflow;
     }
     while(next < n)
     {
@@ -226,9 +260,156 @@ insert_hits:
     goto save_queue;
 
 overflow:
-    hit[MAX_QUEUE_LEN - 1].group_id = ray->root.group_id;
-    hit[MAX_QUEUE_LEN - 1].local_id = ray->root.local_id;
-    goto save_queue;
+    hit[MAX_QUEUE_LEN - 1].group_id = data->cam.root_group;
+    hit[MAX_QUEUE_LEN - 1].local_id = (uint2)(data->cam.root_local, 0);
+
+save_queue:
+    if(!queue_len)
+    {
+        material_id = RAY(material_id);  goto pop_queue;
+    }
+    for(uint i = 1; i < queue_len; i++)tail[queue_len - 1 - i] = hit[i];
+    RAY(start_min).w = RAY(head).pos;  RAY(head) = hit[0];  RAY(queue_len) = queue_len;
+    group_id = hit[0].group_id;  goto assign_index;
+}
+
+KERNEL void process(global GlobalData *data, global float4 *area,
+    global RayList *ray_list, global uint2 *ray_index,
+    const global Group *grp_list, const global Matrix *mat_list,
+    const global AABB *aabb, const global Vertex *vtx, const global uint *tri, const global float4 *rec,
+    global RayHit *queue_list)
+{
+    local uint key[2], done[2];  // bits set in any / all group ids of the unit (radix sort only), finished rays
+    if(!get_local_id(0))
+    {
+        key[0] = 0;  key[1] = GROUP_ID_MASK;  done[rt_primary] = done[rt_shadow] = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+#ifdef PERSISTENT  // fixed number of units fetching batches until all rays are done
+    local uint batch;
+    for(const uint n = data->ray_count;;)
+    {
+        if(!get_local_id(0))batch = atomic_add(&data->work_next, UNIT_WIDTH);
+        barrier(CLK_LOCAL_MEM_FENCE);  const uint offs = batch;
+        barrier(CLK_LOCAL_MEM_FENCE);  if(offs >= n)break;  const uint index = offs + get_local_id(0);
+#else
+    {
+        const uint index = get_global_id(0), n = data->ray_count;
+#endif
+        if(index < n)
+        {
+            uint group_id = GROUP_ID_MASK & trace_ray(data, area, ray_list, ray_index,
+                grp_list, mat_list, aabb, vtx, tri, rec, queue_list, done, index);
+#ifndef BIN_SORT
+            atomic_or(&key[0], group_id);  atomic_and(&key[1], group_id);
+#endif
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);  if(get_local_id(0))return;
+#ifndef BIN_SORT
+    atomic_or(&data->key_or, key[0]);  atomic_and(&data->key_and, key[1]);
+#endif
+    atomic_add(&data->done_count[rt_primary], done[rt_primary]);  atomic_add(&data->done_count[rt_shadow], done[rt_shadow]);
+}
+
+
+// stack traversal: whole hierarchy of one ray per launch, alternative to process
+
+uint trace_hit(const Ray *ray, const global Camera *cam, bool any_hit, float4 *norm_pos,
+    const global Group *grp_list, const global Matrix *mat_list,
+    const global AABB *aabb, const global Vertex *vtx, const global uint *tri, const global float4 *rec, volatile global uint *lost)
+{
+    RayHit stack[TRACE_STACK], hit[MAX_HITS + 1];  uint sp = 1, material_id = 0xFFFFFFFF;
+    stack[0].pos = ray->min;  stack[0].group_id = cam->root_group;  stack[0].local_id = (uint2)(cam->root_local, 0);
+    float best = ray->max, start = ray->min, restart = INFINITY;  // start -- of current pass, restart -- nearest dropped entry
+    for(;;)
+    {
+        if(!sp)
+        {
+            if(!(restart < best))break;  // restart > start, every pass advances
+            stack[0].pos = start = restart;  stack[0].group_id = cam->root_group;
+            stack[0].local_id = (uint2)(cam->root_local, 0);  sp = 1;  restart = INFINITY;
+        }
+        RayHit cur = stack[--sp];  if(!(cur.pos < best))continue;
+
+        Ray loc;  float3 mat[4];  float4 res;  uint n = 0, id = 0xFFFFFFFF;
+        transform_ray(cur.group_id, cur.local_id, ray, &loc, mat, mat_list);  loc.max = best;
+        const global Group *grp = &grp_list[cur.group_id & GROUP_ID_MASK];
+        switch((cur.group_id >> GROUP_SH_SHIFT) & GROUP_SH_MASK)
+        {
+        case sh_aabb:              n = aabb_shader(&loc, &grp->aabb, &cur, hit, aabb, lost);  break;
+        case sh_mesh:              id = mesh_shader(&loc, &grp->mesh, &res, vtx, tri, false, any_hit);  break;
+        case sh_mesh_wide:         id = mesh_shader(&loc, &grp->mesh, &res, vtx, tri, true, any_hit);  break;
+        case sh_mesh_record:       id = mesh_record_shader(&loc, &grp->mesh, &res, vtx, rec, 3, any_hit);  break;
+        case sh_mesh_record_norm:  id = mesh_record_shader(&loc, &grp->mesh, &res, vtx, rec, 4, any_hit);  break;
+        }
+        if(id != 0xFFFFFFFF)
+        {
+            material_id = id;  best = res.w;  if(any_hit)break;
+            norm_pos->xyz = mat[0] * res.x + mat[1] * res.y + mat[2] * res.z;  norm_pos->w = best;  continue;
+        }
+
+        sort_hits(hit, n);  // nearest on top
+        for(uint i = n; i-- > 0;)
+        {
+            if(!(hit[i].pos < best))continue;
+            if(sp == TRACE_STACK)  // drop the farthest entry, revisit from root in next pass
+            {
+                uint far = 0;  for(uint j = 1; j < sp; j++)if(stack[j].pos > stack[far].pos)far = j;
+                float pos = max(stack[far].pos, hit[i].pos);
+                if(pos > start)restart = min(restart, pos);
+                else atomic_inc(lost);  // full stack of entries at pass start, revisit cannot advance
+                if(!(stack[far].pos > hit[i].pos))continue;
+                for(uint j = far + 1; j < sp; j++)stack[j - 1] = stack[j];  sp--;
+            }
+            stack[sp++] = hit[i];
+        }
+    }
+    return material_id;
+}
+
+void atomic_add_float(volatile global float *ptr, float add)
+{
+    uint old = as_uint(*ptr), prev;
+    while((prev = atomic_cmpxchg((volatile global uint *)ptr, old, as_uint(as_float(old) + add))) != old)old = prev;
+}
+
+void add_color(global float4 *res, float4 color)  // samples of one pixel can meet in one launch
+{
+    volatile global float *ptr = (volatile global float *)res;
+    atomic_add_float(ptr + 0, color.x);  atomic_add_float(ptr + 1, color.y);
+    atomic_add_float(ptr + 2, color.z);  atomic_add_float(ptr + 3, color.w);
+}
+
+KERNEL void trace_stack(global GlobalData *data, global float4 *area,
+    const global Group *grp_list, const global Matrix *mat_list,
+    const global AABB *aabb, const global Vertex *vtx, const global uint *tri, const global float4 *rec, uint pixel_offset)
+{
+    const uint index = get_global_id(0);  const global Camera *cam = &data->cam;
+    local uint done[2];  // finished rays by type
+    if(!get_local_id(0))done[rt_primary] = done[rt_shadow] = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    Ray ray;  float4 norm_pos, weight = 1;
+    uint pixel = camera_ray(cam, index + pixel_offset, &ray.dir);
+    ray.start = cam->eye;  ray.min = 0.001;  ray.max = INFINITY;
+    uint material_id = trace_hit(&ray, cam, false, &norm_pos, grp_list, mat_list, aabb, vtx, tri, rec, &data->lost_hits);
+    atomic_inc(&done[rt_primary]);
+    if(material_id == 0xFFFFFFFF)add_color(&area[pixel], weight * (float4)(SKY_COLOR, 1));
+    else
+    {
+        const float3 light = LIGHT_DIR;
+        float3 color = material_color(&grp_list[material_id & GROUP_ID_MASK].material, ray.dir, normalize(norm_pos.xyz), light);
+        weight *= (float4)(color, 1);  ray.start += norm_pos.w * ray.dir;  ray.dir = light;  ray.min = 0.001;  ray.max = INFINITY;
+        if(trace_hit(&ray, cam, true, &norm_pos, grp_list, mat_list, aabb, vtx, tri, rec, &data->lost_hits) != 0xFFFFFFFF)
+            add_color(&area[pixel], (float4)(0, 0, 0, weight.w));
+        else add_color(&area[pixel], weight * (float4)(LIGHT_COLOR, 1));
+        atomic_inc(&done[rt_shadow]);
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);  if(get_local_id(0))return;
+    atomic_add(&data->done_count[rt_primary], done[rt_primary]);  atomic_add(&data->done_count[rt_shadow], done[rt_shadow]);
+    if(!index)data->pixel_offset = pixel_offset + get_global_size(0);
 }
 
 
@@ -252,58 +433,99 @@ KERNEL void count_groups(global GlobalData *data,
     for(; prev < next; prev++)grp_data[prev].count.s0 = offs;
 }
 
-KERNEL void update_groups(global GlobalData *data, global GroupData *grp_data)  // single unit
+KERNEL void clear_bins(global GroupData *grp_data)
+{
+    grp_data[get_global_id(0)].count.s0 = 0;
+}
+
+KERNEL void count_bins(const global GlobalData *data, global GroupData *grp_data,
+    const global uint2 *ray_index, global uint *rank)  // unsorted alternative to count_groups
 {
-    const uint index = get_global_id(0), cur = UNIT_WIDTH + index, n = data->group_count;
-    local uint2 buf[2 * UNIT_WIDTH];  buf[index] = 0;  uint2 offset = 0;  uint prev = 0;
-    for(uint pos = index; pos < n; pos += UNIT_WIDTH)
+    const uint index = get_global_id(0);  if(index >= data->ray_count)return;
+    rank[index] = atomic_inc((global uint *)&grp_data[ray_index[index].s0 & GROUP_ID_MASK].count);
+}
+
+uint2 scan_groups(local uint2 *buf, uint2 val)  // buf[2 * UNIT_WIDTH], inclusive
+{
+    const uint index = get_local_id(0) + UNIT_WIDTH;
+    for(uint offs = 1; offs < UNIT_WIDTH; offs *= 2)
     {
-        GroupData grp;
-        grp.count.s0 = buf[cur].s0 = grp_data[pos].count.s0;
-        barrier(CLK_LOCAL_MEM_FENCE);
-        if(index)grp.base.s0 = buf[cur - 1].s0;
-        else
-        {
-            grp.base.s0 = prev;  prev = buf[2 * UNIT_WIDTH - 1].s0;
-        }
-        barrier(CLK_LOCAL_MEM_FENCE);  grp.count.s0 -= grp.base.s0;
-        grp.base.s1 = grp_data[pos].offset.s1 - grp.count.s0;
-        grp.count.s0 += grp_data[pos].count.s1;
-
-        grp.count.s1 = grp.count.s0;
-        if(pos != n - 1)grp.count.s1 %= WARP_WIDTH;
-        grp.count.s0 -= grp.count.s1;  uint2 res = grp.count;
-        for(uint offs = 1; offs < UNIT_WIDTH; offs *= 2)
-        {
-            buf[cur] = res;  barrier(CLK_LOCAL_MEM_FENCE);
-            res += buf[cur - offs];  barrier(CLK_LOCAL_MEM_FENCE);
-        }
-        buf[cur] = res;  barrier(CLK_LOCAL_MEM_FENCE);
-        if(!pos)
-        {
-            data->pixel_offset += data->pixel_count;  data->pixel_count = grp.count.s0;
-        }
-        grp.offset = offset + res - grp.count;  offset += buf[2 * UNIT_WIDTH - 1];
-        grp_data[pos] = grp;  barrier(CLK_LOCAL_MEM_FENCE);
+        buf[index] = val;  barrier(CLK_LOCAL_MEM_FENCE);
+        val += buf[index - offs];  barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    buf[index] = val;  barrier(CLK_LOCAL_MEM_FENCE);  return val;
+}
+
+uint2 split_group(uint count, uint pos, uint n)  // full warps, remainder
+{
+    uint rem = pos != n - 1 ? count % WARP_WIDTH : count;  return (uint2)(count - rem, rem);
+}
+
+KERNEL void reduce_groups(const global GlobalData *data, global GroupData *grp_data, global uint2 *grp_sum, uint binned)
+{
+    const uint index = get_local_id(0), pos = get_global_id(0);
+    uint base = binned || !pos ? 0 : grp_data[pos - 1].count.s0;  // count.s0 is group end or group size
+    uint count = grp_data[pos].count.s0 - base + grp_data[pos].count.s1;
+
+    local uint2 buf[2 * UNIT_WIDTH];  buf[index] = 0;
+    uint2 res = scan_groups(buf, split_group(count, pos, data->group_count));
+    grp_data[pos].base.s0 = base;  if(index == UNIT_WIDTH - 1)grp_sum[get_group_id(0)] = res;
+}
+
+KERNEL void scan_group_sums(global GlobalData *data, global uint2 *grp_sum)  // single unit
+{
+    const uint index = get_global_id(0), n = data->group_count / UNIT_WIDTH;
+    local uint2 buf[2 * UNIT_WIDTH];  buf[index] = 0;  uint2 offset = 0;
+    for(uint base = 0; base < n; base += UNIT_WIDTH)
+    {
+        uint pos = base + index;  uint2 val = pos < n ? grp_sum[pos] : 0;
+        uint2 res = scan_groups(buf, val);  if(pos < n)grp_sum[pos] = offset + res - val;
+        offset += buf[2 * UNIT_WIDTH - 1];  barrier(CLK_LOCAL_MEM_FENCE);
     }
-    for(uint pos = index; pos < n; pos += UNIT_WIDTH)grp_data[pos].offset.s1 += offset.s0;
     if(index)return;  data->old_count = data->ray_count;  data->ray_count = offset.s0;
+    data->key_or = 0;  data->key_and = GROUP_ID_MASK;  data->work_next = 0;
+}
+
+KERNEL void update_groups(global GlobalData *data, global GroupData *grp_data, const global uint2 *grp_sum)
+{
+    const uint index = get_local_id(0), pos = get_global_id(0);
+    GroupData grp = grp_data[pos];  grp.count.s0 -= grp.base.s0;
+    grp.base.s1 = grp.offset.s1 - grp.count.s0;
+    grp.count = split_group(grp.count.s0 + grp.count.s1, pos, data->group_count);
+
+    local uint2 buf[2 * UNIT_WIDTH];  buf[index] = 0;
+    uint2 res = scan_groups(buf, grp.count);
+    grp.offset = grp_sum[get_group_id(0)] + res - grp.count;  grp.offset.s1 += data->ray_count;
+    if(!pos)
+    {
+        data->pixel_offset += data->pixel_count;  data->pixel_count = grp.count.s0;
+    }
+    grp_data[pos] = grp;
 }
 
 KERNEL void set_ray_index(const global GlobalData *data, const global GroupData *grp_data,
-    const global uint2 *src_index, global uint2 *dst_index)
+    const global uint2 *src_index, global uint2 *dst_index, const global uint *rank, uint binned)
 {
     uint index = get_global_id(0);  uint2 src = src_index[index];
     GroupData grp = grp_data[src.s0 & GROUP_ID_MASK];
-    index -= (index < data->old_count ? grp.base.s0 : grp.base.s1);
+    if(index >= data->old_count)index -= grp.base.s1;
+    else index = binned ? rank[index] : index - grp.base.s0;
     if(index < grp.count.s1)index += grp.offset.s1;
     else index += grp.offset.s0 - grp.count.s1;
     dst_index[index] = src;
 }
 
 
+#ifdef HEADLESS
+KERNEL void update_image(global GlobalData *data, global float4 *area, global float4 *image)
+{
+    uint index = get_global_id(0);  float4 color = area[index];
+    image[index] = color / (color.w + 1e-6);
+}
+#else
 KERNEL void update_image(global GlobalData *data, global float4 *area, write_only image2d_t image)
 {
     uint index = get_global_id(0), width = data->cam.width;  float4 color = area[index];
     write_imagef(image, (int2)(index % width, index / width), pow(color / (color.w + 1e-6), 1 / 2.2));
 }
+#endif
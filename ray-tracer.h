@@ -33,9 +33,16 @@ typedef union
     };
 } AABB;
 
+typedef struct
+{
+    uint min, max;  // 8-bit xyz, relative to group box
+    uint group_id, local_id;
+} QuantizedAABB;
+
 enum AABBFlags
 {
-    f_local0 = 1, f_local1 = 2
+    f_local0 = 1, f_local1 = 2,
+    f_quantized = 4  // AABB header (min -- origin, max -- scale), then QuantizedAABB pairs
 };
 
 typedef struct
@@ -56,6 +63,13 @@ typedef struct
     uint vtx_offs, tri_offs, tri_count, material_id;
 } MeshShader;
 
+// sh_mesh: one uint per triangle, three 10-bit vertex indices
+// sh_mesh_wide: two uints per triangle, three 16-bit vertex indices
+// sh_mesh_record: (vertex0, edge1, edge2) float4 records, vertex indices in w
+// sh_mesh_record_norm: (vertex0, edge1, edge2, cross(edge1, edge2))
+#define MESH_INDEX_BITS       10
+#define MESH_WIDE_INDEX_BITS  16
+
 
 // group description
 
@@ -72,7 +86,7 @@ enum TransformType
 
 enum ShaderType
 {
-    sh_spawn = 0, sh_sky, sh_light, sh_material, sh_aabb, sh_mesh
+    sh_spawn = 0, sh_sky, sh_light, sh_material, sh_aabb, sh_mesh, sh_mesh_wide, sh_mesh_record, sh_mesh_record_norm
 };
 
 enum PredefinedGroups
@@ -107,6 +121,11 @@ typedef struct
 {
     uint pixel_offset, pixel_count;
     uint group_count, old_count, ray_count;  // counts must be multiple of UNIT_WIDTH
+    uint key_or, key_and;  // group id bits set in any / all rays after process
+    uint sort_passes;  // radix passes run on device, skipped constant digits excluded
+    uint lost_hits;  // AABB hits dropped where a revisit cannot advance past the ray start
+    uint done_count[2];  // finished primary / shadow rays
+    uint work_next;  // next ray batch of persistent process
     Camera cam;
 } GlobalData;
 
@@ -160,17 +179,21 @@ enum RayType
 };
 
 #define MAX_QUEUE_LEN  8
+#define TRACE_DEPTH   32  // hierarchy levels kept without overflow
+#define TRACE_STACK   (MAX_HITS + 1 + TRACE_DEPTH)  // per-thread stack of trace kernel: one AABB node plus ancestors
 
 typedef struct
 {
     float4 weight;
     uint pixel, type, material_id, queue_len;
-    Ray ray;  float3 norm;  RayHit root, orig;
-    RayHit queue[MAX_QUEUE_LEN];
+    float4 start_min, dir_max;  // Ray
+    float3 norm;  RayHit head;  // other MAX_QUEUE_LEN - 1 entries in separate buffer
 } RayQueue;
 
 
+#ifndef RADIX_SHIFT  // host selects digit width per device and scene
 #define RADIX_SHIFT             5
+#endif
 #define RADIX_MAX       (1 << RADIX_SHIFT)
 #define RADIX_MASK        (RADIX_MAX - 1)
 
@@ -0,0 +1,119 @@
+// scene-cache.cpp : binary cache of built scene arrays
+//
+
+#include "scene-cache.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <cstdio>
+#include <iostream>
+
+using namespace std;
+
+
+
+struct CacheHeader  // sections follow at page boundaries
+{
+    char magic[8];  cl_uint version, root_group;  cl_ulong key, group_count;
+    cl_ulong offset[5], count[5];  // groups, AABBs, vertices, triangles, records
+};
+
+static const char cache_magic[8] = "RTSCENE";
+static const size_t page_size = 4096;
+static const size_t item_size[5] = {sizeof(Group), sizeof(AABB), sizeof(Vertex), sizeof(cl_uint), sizeof(cl_float4)};
+
+
+cl_ulong hash_data(const void *ptr, size_t size, cl_ulong hash)
+{
+    const unsigned char *buf = static_cast<const unsigned char *>(ptr);
+    for(size_t i = 0; i < size; i++)hash = (hash ^ buf[i]) * 1099511628211ull;
+    return hash;
+}
+
+bool hash_file(const char *file, cl_ulong &hash)
+{
+    FILE *input = fopen(file, "rb");  if(!input)return false;
+    char buf[65536];  size_t len;
+    while((len = fread(buf, 1, sizeof(buf), input)))hash = hash_data(buf, len, hash);
+    bool res = !ferror(input);  fclose(input);  return res;
+}
+
+
+bool SceneCache::open(const char *file, cl_ulong key, SceneData &scene)
+{
+    close();  int fd = ::open(file, O_RDONLY);  if(fd < 0)return false;
+    struct stat info;
+    if(!fstat(fd, &info) && size_t(info.st_size) >= sizeof(CacheHeader))
+    {
+        ptr = mmap(0, size = info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if(ptr == MAP_FAILED)ptr = 0;
+    }
+    ::close(fd);  if(!ptr)return false;
+
+    const CacheHeader *head = static_cast<const CacheHeader *>(ptr);
+    bool valid = !memcmp(head->magic, cache_magic, sizeof(cache_magic)) &&
+        head->version == version && head->key == key && head->group_count <= head->count[0];
+    for(int i = 0; i < 5 && valid; i++)
+        valid = head->offset[i] <= size && head->count[i] <= (size - head->offset[i]) / item_size[i];
+    if(!valid)
+    {
+        close();  return false;
+    }
+
+    char *base = static_cast<char *>(ptr);
+    scene.grp = reinterpret_cast<Group *>(base + head->offset[0]);  scene.grp_count = head->group_count;
+    scene.aabb = reinterpret_cast<AABB *>(base + head->offset[1]);  scene.aabb_count = head->count[1];
+    scene.vtx = reinterpret_cast<Vertex *>(base + head->offset[2]);  scene.vtx_count = head->count[2];
+    scene.tri = reinterpret_cast<cl_uint *>(base + head->offset[3]);  scene.tri_count = head->count[3];
+    scene.rec = reinterpret_cast<cl_float4 *>(base + head->offset[4]);  scene.rec_count = head->count[4];
+    scene.root_group = head->root_group;  return true;
+}
+
+void SceneCache::close()
+{
+    if(ptr)munmap(ptr, size);  ptr = 0;  size = 0;
+}
+
+
+static bool write_zero(FILE *output, size_t size)
+{
+    static const char zero[page_size] = {};
+    for(size_t len = min(size, page_size); size; size -= len, len = min(size, page_size))
+        if(fwrite(zero, 1, len, output) != len)return false;
+    return true;
+}
+
+bool SceneCache::write(const char *file, cl_ulong key, const SceneData &scene, size_t group_space)
+{
+    const void *src[5] = {scene.grp, scene.aabb, scene.vtx, scene.tri, scene.rec};
+    const size_t used[5] = {scene.grp_count, scene.aabb_count, scene.vtx_count, scene.tri_count, scene.rec_count};
+
+    CacheHeader head;  memset(&head, 0, sizeof(head));  memcpy(head.magic, cache_magic, sizeof(cache_magic));
+    head.version = version;  head.root_group = scene.root_group;  head.key = key;  head.group_count = scene.grp_count;
+    for(size_t i = 0, pos = sizeof(head); i < 5; pos += head.count[i] * item_size[i], i++)
+    {
+        head.offset[i] = pos = (pos + page_size - 1) / page_size * page_size;
+        head.count[i] = i ? used[i] : max(used[i], group_space);
+    }
+
+    char tmp[1024];  snprintf(tmp, sizeof(tmp), "%s.tmp", file);  // concurrent readers see old or new file
+    FILE *output = fopen(tmp, "wb");
+    if(!output)
+    {
+        cout << "Cannot open file \"" << tmp << "\"!" << endl;  return false;
+    }
+    bool res = fwrite(&head, sizeof(head), 1, output) == 1;
+    for(size_t i = 0, pos = sizeof(head); i < 5 && res; pos = head.offset[i] + head.count[i] * item_size[i], i++)
+    {
+        res = write_zero(output, head.offset[i] - pos);
+        if(res && used[i])res = fwrite(src[i], item_size[i], used[i], output) == used[i];
+        if(res)res = write_zero(output, (head.count[i] - used[i]) * item_size[i]);
+    }
+    if(fclose(output) || !res || rename(tmp, file))
+    {
+        remove(tmp);  cout << "Cannot write file \"" << file << "\"!" << endl;  return false;
+    }
+    return true;
+}
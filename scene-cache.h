@@ -0,0 +1,34 @@
+// scene-cache.h : binary cache of built scene arrays
+//
+
+#pragma once
+
+#include "model.h"
+
+
+
+cl_ulong hash_data(const void *ptr, size_t size, cl_ulong hash = 14695981039346656037ull);  // FNV-1a
+bool hash_file(const char *file, cl_ulong &hash);
+
+
+class SceneCache  // private file mapping, arrays can back CL_MEM_USE_HOST_PTR buffers
+{
+    void *ptr;  size_t size;
+
+public:
+    static const cl_uint version = 1;
+
+    SceneCache() : ptr(0), size(0)
+    {
+    }
+
+    ~SceneCache()
+    {
+        close();
+    }
+
+    bool open(const char *file, cl_ulong key, SceneData &scene);  // false if absent or stale
+    void close();
+
+    static bool write(const char *file, cl_ulong key, const SceneData &scene, size_t group_space);  // groups zero-padded
+};
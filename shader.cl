@@ -2,45 +2,52 @@
 //
 
 
+#define SKY_COLOR    (float3)(0.5, 1.0, 1.0)
+#define LIGHT_COLOR  (float3)(1, 1, 1)
+#define LIGHT_DIR    normalize((float3)(1, -1, 1))
 
-uint sky_shader(global float4 *area, global RayQueue *ray, const global MatShader *shader)
+
+uint sky_shader(global float4 *area, RAY_PARAM, const global MatShader *shader)
 {
-    float3 color = (float3)(0.5, 1.0, 1.0);
-    area[ray->pixel] += ray->weight * (float4)(color, 1);
-    return ray->queue[0].group_id = spawn_group;
+    area[RAY(pixel)] += RAY(weight) * (float4)(SKY_COLOR, 1);
+    return RAY(head).group_id = spawn_group;
 }
 
-uint light_shader(global float4 *area, global RayQueue *ray, const global MatShader *shader)
+uint light_shader(global float4 *area, RAY_PARAM, const global MatShader *shader)
 {
-    const float3 color = (float3)(1, 1, 1);
-    area[ray->pixel] += ray->weight * (float4)(color, 1);
-    return ray->queue[0].group_id = spawn_group;
+    area[RAY(pixel)] += RAY(weight) * (float4)(LIGHT_COLOR, 1);
+    return RAY(head).group_id = spawn_group;
 }
 
-uint mat_shader(global float4 *area, global RayQueue *ray, const global MatShader *shader)
+float3 material_color(const global MatShader *shader, float3 dir, float3 norm, float3 light)
 {
-    const float3 light = normalize((float3)(1, -1, 1));
-
     const float alpha = 100, f0 = 0.04;
-    float3 dir = ray->ray.dir, norm = normalize(ray->norm), hvec = normalize(light - dir);
+    float3 hvec = normalize(light - dir);
     float spec = (alpha + 2) / 8 * pow(max(0.0, dot(norm, hvec)), alpha);
     spec *= f0 + (1 - f0) * pow(max(0.0, -dot(dir, hvec)), 5);
-    float3 color = (shader->color.xyz + spec * shader->color.w) * max(0.0, dot(light, norm));
+    return (shader->color.xyz + spec * shader->color.w) * max(0.0, dot(light, norm));
+}
 
-    //float4 weight = ray->weight;
-    //area[ray->pixel] += 0.5 * weight * (float4)(color, 1);  ray->weight = 0.5 * weight;
+uint mat_shader(global float4 *area, RAY_PARAM, const global MatShader *shader, const global Camera *cam)
+{
+    const float3 light = LIGHT_DIR;
+    float3 dir = RAY(dir_max).xyz, color = material_color(shader, dir, normalize(RAY(norm)), light);
+
+    //float4 weight = RAY(weight);
+    //area[RAY(pixel)] += 0.5 * weight * (float4)(color, 1);  RAY(weight) = 0.5 * weight;
 
-    ray->weight *= (float4)(color, 1);  ray->type = rt_shadow;
-    ray->ray.start_min.xyz += ray->ray.max * dir;  ray->ray.dir_max.xyz = light;
-    return reset_ray(ray, ray->root.group_id, ray->root.local_id, light_group);
+    RAY(weight) *= (float4)(color, 1);  RAY(type) = rt_shadow;
+    RAY(start_min).xyz += RAY(dir_max).w * dir;  RAY(dir_max).xyz = light;
+    return reset_ray(RAY_ARGS, cam->root_group, (uint2)(cam->root_local, 0), light_group);
 
-    /*ray->ray.start_min.xyz += ray->ray.max * dir;
-    ray->ray.dir_max.xyz = dir - 2 * dot(dir, norm) * norm;
-    return reset_ray(ray, ray->root.group_id, ray->root.local_id, sky_group);*/
+    /*RAY(start_min).xyz += RAY(dir_max).w * dir;
+    RAY(dir_max).xyz = dir - 2 * dot(dir, norm) * norm;
+    return reset_ray(RAY_ARGS, cam->root_group, (uint2)(cam->root_local, 0), sky_group);*/
 }
 
 
-void transform(uint group_id, const global RayQueue *ray, Ray *res, float3 res_mat[4], const global Matrix *mat_list) 
+void transform_ray(uint group_id, uint2 local_id, const Ray *ray,
+    Ray *res, float3 res_mat[4], const global Matrix *mat_list)
 {
     switch((group_id >> GROUP_TR_SHIFT) & GROUP_TR_MASK)
     {
@@ -49,18 +56,18 @@ void transform(uint group_id, const global RayQueue *ray, Ray *res, float3 res_m
         res_mat[1] = (float3)(0, 1, 0);
         res_mat[2] = (float3)(0, 0, 1);
         res_mat[3] = (float3)(0, 0, 0);
-        *res = ray->ray;
+        res->start_min = ray->start_min;  res->dir_max = ray->dir_max;
         break;
 
     case tr_ortho:
         {
-            Matrix mat = mat_list[ray->queue[0].local_id.s0];
+            Matrix mat = mat_list[local_id.s0];
             res_mat[0] = (float3)(mat.x.x, mat.y.x, mat.z.x);
             res_mat[1] = (float3)(mat.x.y, mat.y.y, mat.z.y);
             res_mat[2] = (float3)(mat.x.z, mat.y.z, mat.z.z);
             res_mat[3] = (float3)(mat.x.w, mat.y.w, mat.z.w);
 
-            *res = ray->ray;  float3 rel = res->start - res_mat[3];
+            res->start_min = ray->start_min;  res->dir_max = ray->dir_max;  float3 rel = res->start - res_mat[3];
             res->start_min.xyz = (mat.x * rel.x + mat.y * rel.y + mat.z * rel.z).xyz;
             res->dir_max.xyz = (mat.x * res->dir.x + mat.y * res->dir.y + mat.z * res->dir.z).xyz;
             break;
@@ -72,34 +79,78 @@ void transform(uint group_id, const global RayQueue *ray, Ray *res, float3 res_m
     }
 }
 
+void transform(uint group_id, RAY_PARAM, Ray *res, float3 res_mat[4], const global Matrix *mat_list)
+{
+    Ray ray;  ray.start_min = RAY(start_min);  ray.dir_max = RAY(dir_max);
+    transform_ray(group_id, RAY(head).local_id, &ray, res, res_mat, mat_list);
+}
 
-uint aabb_shader(const Ray *ray, const global AABBShader *shader,
-    const global RayHit *cur, RayHit *hit, const global AABB *aabb)
+
+uint aabb_list_shader(const Ray *ray, const global AABBShader *shader, const RayHit *cur, RayHit *hit,
+    const global AABB *aabb, volatile global uint *lost, bool quantized)  // hit[MAX_HITS + 1], quantized must be constant
 {
     aabb += shader->aabb_offs;
-    float3 inv_dir = 1 / ray->dir;
-    uint n = shader->aabb_count, hit_count = 0;
+    const global QuantizedAABB *quant = (const global QuantizedAABB *)(aabb + 1);
+    float3 base = aabb[0].min, scale = aabb[0].max;
+
+    float3 inv_dir = 1 / ray->dir;  float t_start = max(ray->min, cur->pos), restart = INFINITY;
+    uint n = shader->aabb_count, hit_count = 0, drop_count = 0;
     int2 flags = (shader->flags & (uint2)(f_local0, f_local1)) != 0;
     uint2 cur_local = cur->local_id;
     for(uint i = 0; i < n; i++)
     {
-        float3 pos1 = (aabb[i].min - ray->start) * inv_dir;
-        float3 pos2 = (aabb[i].max - ray->start) * inv_dir;
+        float3 aabb_min, aabb_max;  uint group_id, local_id;
+        if(quantized)
+        {
+            uint4 val = vload4(i, (const global uint *)quant);
+            aabb_min = convert_float3((uint3)(val.s0) >> (uint3)(0, 8, 16) & 0xFF) * scale + base;
+            aabb_max = convert_float3((uint3)(val.s1) >> (uint3)(0, 8, 16) & 0xFF) * scale + base;
+            group_id = val.s2;  local_id = val.s3;
+        }
+        else
+        {
+            aabb_min = aabb[i].min;  aabb_max = aabb[i].max;
+            group_id = aabb[i].group_id;  local_id = aabb[i].local_id;
+        }
+
+        float3 pos1 = (aabb_min - ray->start) * inv_dir;
+        float3 pos2 = (aabb_max - ray->start) * inv_dir;
         float3 pos_min = min(pos1, pos2), pos_max = max(pos1, pos2);
         float t_min = max(max(pos_min.x, pos_min.y), pos_min.z);
         float t_max = min(min(pos_max.x, pos_max.y), pos_max.z);
-        if(!(t_max > t_min && t_max > ray->min && t_min < ray->max))continue;
+        if(!(t_max > t_min && t_max > t_start && t_min < ray->max))continue;
 
-        if(hit_count >= MAX_HITS)return 0;  // artifacts
+        RayHit res;  res.pos = max(t_min, t_start);
+        res.group_id = group_id;  res.local_id = select(cur_local, local_id, flags);
+        if(hit_count < MAX_HITS)
+        {
+            hit[hit_count++] = res;  continue;
+        }
 
-        hit[hit_count].pos = max(t_min, ray->min);
-        hit[hit_count].group_id = aabb[i].group_id;
-        hit[hit_count].local_id = select(cur_local, aabb[i].local_id, flags);
-        hit_count++;
+        uint far = 0;  // overflow: keep nearest hits
+        for(uint j = 1; j < MAX_HITS; j++)if(hit[j].pos > hit[far].pos)far = j;
+        if(res.pos < hit[far].pos)
+        {
+            RayHit tmp = hit[far];  hit[far] = res;  res = tmp;
+        }
+        restart = min(restart, res.pos);  drop_count++;
     }
+    if(restart < INFINITY && restart > t_start)  // revisit this group past the kept hits
+    {
+        hit[hit_count].pos = restart;  hit[hit_count].group_id = cur->group_id;
+        hit[hit_count].local_id = cur_local;  hit_count++;
+    }
+    else if(drop_count)atomic_add(lost, drop_count);  // more than MAX_HITS children overlap the ray start, revisit cannot advance
     return hit_count;
 }
 
+uint aabb_shader(const Ray *ray, const global AABBShader *shader,
+    const RayHit *cur, RayHit *hit, const global AABB *aabb, volatile global uint *lost)  // lost -- counter of dropped hits
+{
+    if(shader->flags & f_quantized)return aabb_list_shader(ray, shader, cur, hit, aabb, lost, true);
+    return aabb_list_shader(ray, shader, cur, hit, aabb, lost, false);
+}
+
 
 uint sphere_shader(const Ray *ray, uint material_id, float4 *norm_pos)
 {
@@ -112,28 +163,64 @@ uint sphere_shader(const Ray *ray, uint material_id, float4 *norm_pos)
     *norm_pos = (float4)(ray->start + pos * ray->dir, pos);  return material_id;
 }
 
+bool triangle_hit(const Ray *ray, float3 r, float3 p, float3 q, float3 n, float4 *norm_pos, float2 *uv)
+{
+    r -= ray->start;  float w = dot(ray->dir, n);  /*if(!(w > 0))return false;*/  w = 1 / w;
+    float t = dot(r, n) * w;  if(!(t > ray->min && t < norm_pos->w))return false;
+    float3 dr = cross(ray->dir, r);  float u = -dot(q, dr) * w, v = dot(p, dr) * w;
+    if(!(u >= 0 && v >= 0 && u + v <= 1))return false;
+
+    norm_pos->w = t;  *uv = (float2)(u, v);  return true;
+}
+
+float3 interpolate_normal(const global Vertex *vtx, uint3 index, float2 uv)
+{
+    return vtx[index.s0].norm * (1 - uv.x - uv.y) + vtx[index.s1].norm * uv.x + vtx[index.s2].norm * uv.y;
+}
+
+uint3 triangle_index(const global uint *tri, uint i, bool wide)
+{
+    if(!wide)return (tri[i] >> (uint3)(0, 10, 20)) & 0x3FF;
+    uint2 val = vload2(i, tri);  return (uint3)(val.s0 & 0xFFFF, val.s0 >> 16, val.s1);
+}
+
 uint mesh_shader(const Ray *ray, const global MeshShader *shader,
-    float4 *norm_pos, const global Vertex *vtx, const global uint *tri)
+    float4 *norm_pos, const global Vertex *vtx, const global uint *tri, bool wide, bool any_hit)  // wide must be constant
 {
     //return sphere_shader(ray, shader->material_id, norm_pos);
 
     vtx += shader->vtx_offs;  tri += shader->tri_offs;
     uint hit_index = 0xFFFFFFFF, n = shader->tri_count;
-    float hit_u, hit_v;  norm_pos->w = ray->max;
+    float2 uv;  norm_pos->w = ray->max;
     for(uint i = 0; i < n; i++)
     {
-        uint3 index = (tri[i] >> (uint3)(0, 10, 20)) & 0x3FF;
-        float3 r = vtx[index.s0].pos, p = vtx[index.s1].pos - r, q = vtx[index.s2].pos - r;  r -= ray->start;
-        float3 n = cross(p, q);  float w = dot(ray->dir, n);  /*if(!(w > 0))continue;*/  w = 1 / w;
-        float t = dot(r, n) * w;  if(!(t > ray->min && t < norm_pos->w))continue;
-        float3 dr = cross(ray->dir, r);  float u = -dot(q, dr) * w, v = dot(p, dr) * w;
-        if(!(u >= 0 && v >= 0 && u + v <= 1))continue;
-
-        norm_pos->w = t;  hit_u = u;  hit_v = v;  hit_index = i;
+        uint3 index = triangle_index(tri, i, wide);
+        float3 r = vtx[index.s0].pos, p = vtx[index.s1].pos - r, q = vtx[index.s2].pos - r;
+        if(!triangle_hit(ray, r, p, q, cross(p, q), norm_pos, &uv))continue;
+        hit_index = i;  if(any_hit)break;
     }
-    if(hit_index == 0xFFFFFFFF)return 0xFFFFFFFF;
+    if(hit_index == 0xFFFFFFFF)return 0xFFFFFFFF;  if(any_hit)return shader->material_id;  // no normal for occlusion
 
-    uint3 index = (tri[hit_index] >> (uint3)(0, 10, 20)) & 0x3FF;
-    norm_pos->xyz = vtx[index.s0].norm * (1 - hit_u - hit_v) + vtx[index.s1].norm * hit_u + vtx[index.s2].norm * hit_v;
+    norm_pos->xyz = interpolate_normal(vtx, triangle_index(tri, hit_index, wide), uv);
     return shader->material_id;
 }
+
+uint mesh_record_shader(const Ray *ray, const global MeshShader *shader,
+    float4 *norm_pos, const global Vertex *vtx, const global float4 *rec, uint stride, bool any_hit)  // stride must be constant
+{
+    vtx += shader->vtx_offs;  rec += shader->tri_offs;
+    uint hit_index = 0xFFFFFFFF, n = shader->tri_count;
+    float2 uv;  norm_pos->w = ray->max;
+    for(uint i = 0; i < n; i++)
+    {
+        const global float4 *cur = rec + i * stride;
+        float3 p = cur[1].xyz, q = cur[2].xyz, norm = stride > 3 ? cur[3].xyz : cross(p, q);
+        if(!triangle_hit(ray, cur[0].xyz, p, q, norm, norm_pos, &uv))continue;
+        hit_index = i;  if(any_hit)break;
+    }
+    if(hit_index == 0xFFFFFFFF)return 0xFFFFFFFF;  if(any_hit)return shader->material_id;
+
+    const global float4 *cur = rec + hit_index * stride;
+    uint3 index = (uint3)(as_uint(cur[0].w), as_uint(cur[1].w), as_uint(cur[2].w));
+    norm_pos->xyz = interpolate_normal(vtx, index, uv);  return shader->material_id;
+}
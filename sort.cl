@@ -16,11 +16,24 @@ uint2 local_scan(local uint *buf, uint val)  // buf[2 * UNIT_WIDTH]
     return (uint2)(res - val, buf[2 * UNIT_WIDTH - 1]);
 }
 
-void KERNEL local_count(const global uint2 *val, const global uint *val_count,
+bool const_digit(const global uint *val_count, uint shift, uint mask)  // val_count[1], [2] -- OR / AND of all keys
+{
+    return !(((val_count[1] ^ val_count[2]) >> shift) & mask);
+}
+
+bool skip_parity(const global uint *val_count, uint shift)  // odd number of skipped passes below shift, data in second buffer
+{
+    uint diff = val_count[1] ^ val_count[2];  bool res = false;
+    for(uint pos = 0; pos < shift; pos += RADIX_SHIFT)res ^= !((diff >> pos) & RADIX_MASK);
+    return res;
+}
+
+void KERNEL local_count(const global uint2 *val, const global uint2 *val_alt, const global uint *val_count,
     global uint *local_index, global uint *global_index, uint shift, uint mask, uint max_val)
 {
     const uint block = get_group_id(0), offs = block * SORT_WIDTH, n = *val_count;
-    if(offs >= n)return;  val += offs;  local_index += offs;  global_index += block * RADIX_MAX;
+    if(offs >= n || const_digit(val_count, shift, mask))return;
+    if(skip_parity(val_count, shift))val = val_alt;  val += offs;  local_index += offs;  global_index += block * RADIX_MAX;
 
     const uint index = get_local_id(0);  uint data[SORT_BLOCK];
     uint block_size = min((uint)SORT_BLOCK, (n - offs + (UNIT_WIDTH - 1) - index) / UNIT_WIDTH);
@@ -42,31 +55,24 @@ void KERNEL local_count(const global uint2 *val, const global uint *val_count,
         local_index[i * UNIT_WIDTH + index] = pos[i] + count[(data[i] >> shift) & mask];
 }
 
-void KERNEL global_count(global uint *global_index, const global uint *val_count, uint max_val)  // single unit
+void KERNEL global_count(global uint *global_index, const global uint *val_count, uint shift, uint mask)  // unit per digit
 {
-    const uint index = get_global_id(0);
+    if(const_digit(val_count, shift, mask))return;
+    const uint index = get_local_id(0), digit = get_group_id(0);
     uint block_count = (*val_count + SORT_WIDTH - 1) / SORT_WIDTH;
     uint2 range = block_count * (uint2)(index, index + 1) / UNIT_WIDTH;
 
-    uint count[RADIX_MAX];
-    for(uint i = 0; i < max_val; i++)
+    uint count = 0;
+    for(uint pos = range.s0; pos < range.s1; pos++)
     {
-        count[i] = 0;
-        for(uint pos = range.s0; pos < range.s1; pos++)
-        {
-            uint k = pos * RADIX_MAX + i;  uint n = global_index[k];
-            global_index[k] = count[i];  count[i] += n;
-        }
+        uint k = pos * RADIX_MAX + digit;  uint n = global_index[k];
+        global_index[k] = count;  count += n;
     }
 
-    local uint buf[2 * UNIT_WIDTH];  buf[index] = 0;  uint offs = 0;
-    for(uint i = 0; i < max_val; i++)
-    {
-        uint2 res = local_scan(buf, count[i]);
-        for(uint pos = range.s0; pos < range.s1; pos++)
-            global_index[pos * RADIX_MAX + i] += offs + res.s0;
-        offs += res.s1;  barrier(CLK_LOCAL_MEM_FENCE);
-    }
+    local uint buf[2 * UNIT_WIDTH];  buf[index] = 0;
+    uint2 res = local_scan(buf, count);
+    for(uint pos = range.s0; pos < range.s1; pos++)global_index[pos * RADIX_MAX + digit] += res.s0;
+    if(!index)global_index[block_count * RADIX_MAX + digit] = res.s1;  // digit totals after last block
 }
 
 uint sort_block_index(uint pos, uint n)
@@ -81,18 +87,29 @@ uint sort_block_index(uint pos, uint n)
     return pos + local_pos / block_size + local_pos % block_size * UNIT_WIDTH;
 }
 
-void KERNEL shuffle_data(const global uint2 *src, global uint2 *dst, const global uint *val_count,
-    const global uint *local_index, const global uint *global_index, uint shift, uint mask, uint last)
+void KERNEL shuffle_data(global uint2 *src, global uint2 *dst, global uint *val_count,
+    const global uint *local_index, const global uint *global_index, uint shift, uint mask, uint max_val)
 {
     const uint block = get_group_id(0), offs = block * SORT_WIDTH, n = *val_count;
-    src += offs;  local_index += offs;  global_index += block * RADIX_MAX;
+    const uint index = get_local_id(0);  local uint buf[2 * UNIT_WIDTH], digit_offs[RADIX_MAX];  // RADIX_MAX <= UNIT_WIDTH
+    if(const_digit(val_count, shift, mask))return;  // data stays in place, later passes swap buffers
+    if(skip_parity(val_count, shift))
+    {
+        global uint2 *tmp = src;  src = dst;  dst = tmp;
+    }
+    if(!get_global_id(0))val_count[3]++;  // passes run
+    const bool last = !(((val_count[1] ^ val_count[2]) >> shift) & ~mask);  // no differing digit above, plain order
+    uint total = index < max_val ? global_index[(n + SORT_WIDTH - 1) / SORT_WIDTH * RADIX_MAX + index] : 0;
+    buf[index] = 0;  uint2 res = local_scan(buf, total);  if(index < max_val)digit_offs[index] = res.s0;
+    barrier(CLK_LOCAL_MEM_FENCE);
 
-    const uint index = get_local_id(0);
+    src += offs;  local_index += offs;  global_index += block * RADIX_MAX;
     uint block_size = min((uint)SORT_BLOCK, (max(offs, n) - offs + (UNIT_WIDTH - 1) - index) / UNIT_WIDTH);
     for(uint i = 0; i < block_size; i++)
     {
         uint2 data = src[i * UNIT_WIDTH + index];
-        uint pos = global_index[(data.s0 >> shift) & mask] + local_index[i * UNIT_WIDTH + index];
+        uint digit = (data.s0 >> shift) & mask;
+        uint pos = digit_offs[digit] + global_index[digit] + local_index[i * UNIT_WIDTH + index];
         dst[last ? pos : sort_block_index(pos, n)] = data;
     }
     for(uint i = block_size; i < SORT_BLOCK; i++)
@@ -100,3 +117,9 @@ void KERNEL shuffle_data(const global uint2 *src, global uint2 *dst, const globa
         uint pos = i * UNIT_WIDTH + index;  dst[offs + pos] = src[pos];
     }
 }
+
+void KERNEL sort_finish(global uint2 *dst, const global uint2 *src, const global uint *val_count, uint shift)  // after last pass
+{
+    if(!skip_parity(val_count, shift))return;
+    const uint index = get_global_id(0);  dst[index] = src[index];
+}
@@ -0,0 +1,113 @@
+// thread-pool.cpp -- work-stealing threads for host-side setup
+//
+
+#include "thread-pool.h"
+#include <pthread.h>
+
+using namespace std;
+
+
+
+static thread_local const ThreadPool *cur_pool = 0;
+static thread_local size_t cur_index = 0;
+
+ThreadPool::ThreadPool(size_t thread_count, bool pin) : queued(0), stop(false)
+{
+    const size_t core_count = max(1u, thread::hardware_concurrency());
+    if(!thread_count)thread_count = core_count;
+    queue = new Queue[queue_count = thread_count];
+    for(size_t i = 1; i < thread_count; i++)
+    {
+        worker.push_back(thread(&ThreadPool::work, this, i));  if(!pin)continue;
+        cpu_set_t set;  CPU_ZERO(&set);  CPU_SET(i % core_count, &set);  // failure leaves thread unpinned
+        pthread_setaffinity_np(worker.back().native_handle(), sizeof(set), &set);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<std::mutex> lock(mutex);  stop = true;
+    }
+    cond.notify_all();
+    for(size_t i = 0; i < worker.size(); i++)worker[i].join();
+    delete [] queue;
+}
+
+size_t ThreadPool::current_index() const
+{
+    return cur_pool == this ? cur_index : 0;  // external threads share queue 0
+}
+
+bool ThreadPool::execute(size_t index)
+{
+    Task task;  bool found = false;
+    for(size_t i = 0; i < queue_count && !found; i++)
+    {
+        Queue &cur = queue[(index + i) % queue_count];
+        lock_guard<std::mutex> lock(cur.mutex);  if(cur.task.empty())continue;
+        if(i)
+        {
+            task = cur.task.front();  cur.task.pop_front();
+        }
+        else
+        {
+            task = cur.task.back();  cur.task.pop_back();
+        }
+        found = true;
+    }
+    if(!found)return false;
+
+    queued--;  task.func();  task.group->pending--;  return true;
+}
+
+void ThreadPool::work(size_t index)
+{
+    cur_pool = this;  cur_index = index;
+    for(;;)
+    {
+        if(execute(index))continue;
+        unique_lock<std::mutex> lock(mutex);
+        while(!stop && !queued)cond.wait(lock);
+        if(stop)return;
+    }
+}
+
+void ThreadPool::spawn(TaskGroup &group, const function<void ()> &func)
+{
+    group.pending++;  queued++;  Queue &cur = queue[current_index()];
+    {
+        lock_guard<std::mutex> lock(cur.mutex);
+        Task task = {func, &group};  cur.task.push_back(task);
+    }
+    {
+        lock_guard<std::mutex> lock(mutex);
+    }
+    cond.notify_one();
+}
+
+void ThreadPool::wait(TaskGroup &group)
+{
+    size_t index = current_index();
+    while(group.pending)if(!execute(index))this_thread::yield();
+}
+
+void ThreadPool::run(size_t count, const function<void (size_t)> &func)
+{
+    if(worker.empty() || count < 2)
+    {
+        for(size_t i = 0; i < count; i++)func(i);  return;
+    }
+
+    TaskGroup group;
+    for(size_t i = 0; i < count; i++)spawn(group, [&func, i]
+        {
+            func(i);
+        });
+    wait(group);
+}
+
+void ThreadPool::fork_join(const function<void ()> &func0, const function<void ()> &func1)
+{
+    TaskGroup group;  spawn(group, func1);  func0();  wait(group);
+}
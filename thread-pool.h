@@ -0,0 +1,70 @@
+// thread-pool.h : work-stealing threads for host-side setup
+//
+
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <vector>
+#include <deque>
+
+
+
+class ThreadPool
+{
+public:
+    class TaskGroup
+    {
+        friend class ThreadPool;
+
+        std::atomic<size_t> pending;
+
+    public:
+        TaskGroup() : pending(0)
+        {
+        }
+    };
+
+private:
+    struct Task
+    {
+        std::function<void ()> func;
+        TaskGroup *group;
+    };
+
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Task> task;
+    };
+
+
+    std::vector<std::thread> worker;
+    Queue *queue;  size_t queue_count;
+    std::mutex mutex;  std::condition_variable cond;
+    std::atomic<size_t> queued;  bool stop;
+
+
+    bool execute(size_t index);  // own queue first (LIFO), then steal (FIFO)
+    void work(size_t index);
+
+public:
+    explicit ThreadPool(size_t thread_count = 0, bool pin = false);  // 0 -- all hardware threads, pin -- worker i on core i
+    ~ThreadPool();
+
+    size_t thread_count() const
+    {
+        return queue_count;
+    }
+
+    size_t current_index() const;  // 0 for external threads
+
+    void spawn(TaskGroup &group, const std::function<void ()> &func);
+    void wait(TaskGroup &group);  // executes pending tasks while waiting
+
+    void run(size_t count, const std::function<void (size_t)> &func);  // calls func(0..count-1)
+    void fork_join(const std::function<void ()> &func0, const std::function<void ()> &func1);
+};
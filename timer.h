@@ -0,0 +1,16 @@
+// timer.h : time measurement
+//
+
+#pragma once
+
+#include <ctime>
+
+
+
+typedef long long nsec_type;
+
+inline nsec_type get_time()
+{
+    timespec ts;  clock_gettime(CLOCK_MONOTONIC, &ts);
+    return 1000000000 * nsec_type(ts.tv_sec) + ts.tv_nsec;
+}